@@ -479,6 +479,7 @@ Application::~Application()
 	connect(this, &Application::TSLLoadingFinished, &e, &QEventLoop::quit);
 	if( !d->ready )
 		e.exec();
+	DigiDoc::cancelValidations();
 	digidoc::terminate();
 	delete d;
 
@@ -0,0 +1,468 @@
+/*
+ * QDigiDocCrypto
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include "Base64.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define BASE64_X86
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define TARGET(X)
+#else
+#define TARGET(X) __attribute__((target(X)))
+#endif
+#endif
+
+namespace {
+
+struct Table
+{
+	Table()
+	{
+		memset(value, -1, sizeof(value));
+		for(int i = 0; i < 26; ++i)
+		{
+			value['A' + i] = qint8(i);
+			value['a' + i] = qint8(i + 26);
+		}
+		for(int i = 0; i < 10; ++i)
+			value['0' + i] = qint8(i + 52);
+		value['+'] = 62;
+		value['/'] = 63;
+	}
+
+	qint8 value[256];
+};
+
+const Table TABLE;
+
+const char ALPHABET[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+template<typename T>
+size_t decodeNone(const T * /*in*/, size_t /*size*/, char * /*out*/)
+{
+	return 0;
+}
+
+template<typename T>
+inline T* encodeQuantum(const char *in, size_t size, T *out)
+{
+	const uchar *data = reinterpret_cast<const uchar*>(in);
+	uint v = uint(data[0]) << 16 | (size > 1 ? uint(data[1]) << 8 : 0U) | (size > 2 ? uint(data[2]) : 0U);
+	*out++ = T(ALPHABET[v >> 18]);
+	*out++ = T(ALPHABET[(v >> 12) & 0x3F]);
+	*out++ = size > 1 ? T(ALPHABET[(v >> 6) & 0x3F]) : T('=');
+	*out++ = size > 2 ? T(ALPHABET[v & 0x3F]) : T('=');
+	return out;
+}
+
+template<typename T>
+T* encodeLines(const char *in, size_t lines, T *out)
+{
+	for(size_t i = 0; i < lines; ++i, in += Base64Encoder::LINE_BYTES)
+	{
+		for(size_t j = 0; j < Base64Encoder::LINE_BYTES; j += 3)
+			out = encodeQuantum(in + j, 3, out);
+		*out++ = T('\n');
+	}
+	return out;
+}
+
+#ifdef BASE64_X86
+/*
+ * Vectorized lookup by high and low nibble of the character.
+ * MASK[low] contains bit for every high nibble which forms valid character with this low nibble,
+ * SHIFT[high] is the offset from character code to its value ('/' is handled separately).
+ */
+#define BASE64_LUTS \
+	const __m128i MASK = _mm_setr_epi8(char(0xA8), char(0xF8), char(0xF8), char(0xF8), char(0xF8), char(0xF8), \
+		char(0xF8), char(0xF8), char(0xF8), char(0xF8), char(0xF0), 0x54, 0x50, 0x50, 0x50, 0x54); \
+	const __m128i BITPOS = _mm_setr_epi8(0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, char(0x80), \
+		0, 0, 0, 0, 0, 0, 0, 0); \
+	const __m128i SHIFT = _mm_setr_epi8(0, 0, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0); \
+	const __m128i ORDER = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1)
+
+TARGET("sse4.1")
+inline void store12(char *out, __m128i packed)
+{
+	_mm_storel_epi64(reinterpret_cast<__m128i*>(out), packed);
+	int last = _mm_cvtsi128_si32(_mm_srli_si128(packed, 8));
+	memcpy(out + 8, &last, sizeof(last));
+}
+
+TARGET("sse4.1")
+inline bool decode16(__m128i in, char *out)
+{
+	BASE64_LUTS;
+	const __m128i low = _mm_and_si128(in, _mm_set1_epi8(0x0F));
+	const __m128i high = _mm_and_si128(_mm_srli_epi32(in, 4), _mm_set1_epi8(0x0F));
+	const __m128i valid = _mm_and_si128(_mm_shuffle_epi8(MASK, low), _mm_shuffle_epi8(BITPOS, high));
+	if(_mm_movemask_epi8(_mm_cmpeq_epi8(valid, _mm_setzero_si128())))
+		return false;
+	const __m128i shift = _mm_blendv_epi8(_mm_shuffle_epi8(SHIFT, high), _mm_set1_epi8(16),
+		_mm_cmpeq_epi8(in, _mm_set1_epi8('/')));
+	const __m128i values = _mm_add_epi8(in, shift);
+	const __m128i merged = _mm_madd_epi16(_mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140)), _mm_set1_epi32(0x00011000));
+	store12(out, _mm_shuffle_epi8(merged, ORDER));
+	return true;
+}
+
+TARGET("avx2")
+inline bool decode32(__m256i in, char *out)
+{
+	BASE64_LUTS;
+	const __m256i low = _mm256_and_si256(in, _mm256_set1_epi8(0x0F));
+	const __m256i high = _mm256_and_si256(_mm256_srli_epi32(in, 4), _mm256_set1_epi8(0x0F));
+	const __m256i valid = _mm256_and_si256(_mm256_shuffle_epi8(_mm256_broadcastsi128_si256(MASK), low),
+		_mm256_shuffle_epi8(_mm256_broadcastsi128_si256(BITPOS), high));
+	if(_mm256_movemask_epi8(_mm256_cmpeq_epi8(valid, _mm256_setzero_si256())))
+		return false;
+	const __m256i shift = _mm256_blendv_epi8(_mm256_shuffle_epi8(_mm256_broadcastsi128_si256(SHIFT), high),
+		_mm256_set1_epi8(16), _mm256_cmpeq_epi8(in, _mm256_set1_epi8('/')));
+	const __m256i values = _mm256_add_epi8(in, shift);
+	const __m256i merged = _mm256_madd_epi16(_mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140)), _mm256_set1_epi32(0x00011000));
+	const __m256i packed = _mm256_shuffle_epi8(merged, _mm256_broadcastsi128_si256(ORDER));
+	store12(out, _mm256_castsi256_si128(packed));
+	store12(out + 12, _mm256_extracti128_si256(packed, 1));
+	return true;
+}
+
+// UTF-16 code units above 0xFF saturate to invalid characters when packed
+TARGET("sse4.1")
+inline __m128i load16(const char *in)
+{
+	return _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+}
+
+TARGET("sse4.1")
+inline __m128i load16(const ushort *in)
+{
+	return _mm_packus_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in)),
+		_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 8)));
+}
+
+TARGET("avx2")
+inline __m256i load32(const char *in)
+{
+	return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in));
+}
+
+TARGET("avx2")
+inline __m256i load32(const ushort *in)
+{
+	return _mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in)),
+		_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + 16))), 0xD8);
+}
+
+/*
+ * Spreads 12 bytes to 16 sextets and maps them to the alphabet by the range of the value:
+ * 0-25 'A', 26-51 'a', 52-61 '0', 62 '+' and 63 '/'.
+ * SPREAD_TAIL is used for the last 12 bytes of the line, which are loaded at offset 4.
+ */
+#define BASE64_ENCODE_LUTS \
+	const __m128i SPREAD = _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10); \
+	const __m128i SPREAD_TAIL = _mm_setr_epi8(5, 4, 6, 5, 8, 7, 9, 8, 11, 10, 12, 11, 14, 13, 15, 14); \
+	const __m128i OFFSET = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, \
+		'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0)
+
+TARGET("sse4.1")
+inline __m128i encode12(__m128i in, __m128i spread, __m128i offset)
+{
+	in = _mm_shuffle_epi8(in, spread);
+	const __m128i hi = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0FC0FC00)), _mm_set1_epi32(0x04000040));
+	const __m128i lo = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003F03F0)), _mm_set1_epi32(0x01000010));
+	const __m128i values = _mm_or_si128(hi, lo);
+	__m128i range = _mm_subs_epu8(values, _mm_set1_epi8(51));
+	range = _mm_or_si128(range, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), values), _mm_set1_epi8(13)));
+	return _mm_add_epi8(values, _mm_shuffle_epi8(offset, range));
+}
+
+TARGET("avx2")
+inline __m256i encode24(__m256i in, __m256i spread, __m256i offset)
+{
+	in = _mm256_shuffle_epi8(in, spread);
+	const __m256i hi = _mm256_mulhi_epu16(_mm256_and_si256(in, _mm256_set1_epi32(0x0FC0FC00)), _mm256_set1_epi32(0x04000040));
+	const __m256i lo = _mm256_mullo_epi16(_mm256_and_si256(in, _mm256_set1_epi32(0x003F03F0)), _mm256_set1_epi32(0x01000010));
+	const __m256i values = _mm256_or_si256(hi, lo);
+	__m256i range = _mm256_subs_epu8(values, _mm256_set1_epi8(51));
+	range = _mm256_or_si256(range, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), values), _mm256_set1_epi8(13)));
+	return _mm256_add_epi8(values, _mm256_shuffle_epi8(offset, range));
+}
+
+TARGET("sse4.1")
+inline void store16(char *out, __m128i chars)
+{
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(out), chars);
+}
+
+TARGET("sse4.1")
+inline void store16(ushort *out, __m128i chars)
+{
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_unpacklo_epi8(chars, _mm_setzero_si128()));
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(out + 8), _mm_unpackhi_epi8(chars, _mm_setzero_si128()));
+}
+
+TARGET("avx2")
+inline void store32(char *out, __m256i chars)
+{
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(out), chars);
+}
+
+TARGET("avx2")
+inline void store32(ushort *out, __m256i chars)
+{
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(out), _mm256_cvtepu8_epi16(_mm256_castsi256_si128(chars)));
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(out + 16), _mm256_cvtepu8_epi16(_mm256_extracti128_si256(chars, 1)));
+}
+
+template<typename T>
+TARGET("sse4.1")
+T* encodeSSE(const char *in, size_t lines, T *out)
+{
+	BASE64_ENCODE_LUTS;
+	for(size_t i = 0; i < lines; ++i, in += Base64Encoder::LINE_BYTES, out += Base64Encoder::LINE_SIZE)
+	{
+		store16(out, encode12(load16(in), SPREAD, OFFSET));
+		store16(out + 16, encode12(load16(in + 12), SPREAD, OFFSET));
+		store16(out + 32, encode12(load16(in + 24), SPREAD, OFFSET));
+		store16(out + 48, encode12(load16(in + 32), SPREAD_TAIL, OFFSET));
+		out[64] = T('\n');
+	}
+	return out;
+}
+
+template<typename T>
+TARGET("avx2")
+T* encodeAVX2(const char *in, size_t lines, T *out)
+{
+	BASE64_ENCODE_LUTS;
+	const __m256i spread = _mm256_broadcastsi128_si256(SPREAD);
+	const __m256i spreadTail = _mm256_inserti128_si256(spread, SPREAD_TAIL, 1);
+	const __m256i offset = _mm256_broadcastsi128_si256(OFFSET);
+	for(size_t i = 0; i < lines; ++i, in += Base64Encoder::LINE_BYTES, out += Base64Encoder::LINE_SIZE)
+	{
+		store32(out, encode24(_mm256_inserti128_si256(_mm256_castsi128_si256(load16(in)), load16(in + 12), 1), spread, offset));
+		store32(out + 32, encode24(_mm256_inserti128_si256(_mm256_castsi128_si256(load16(in + 24)), load16(in + 32), 1), spreadTail, offset));
+		out[64] = T('\n');
+	}
+	return out;
+}
+
+TARGET("sse4.1")
+size_t decodeSSE(const char *in, size_t size, char *out)
+{
+	size_t i = 0;
+	for(; i + 16 <= size && decode16(load16(in + i), out); i += 16, out += 12);
+	return i;
+}
+
+TARGET("sse4.1")
+size_t decodeSSE(const ushort *in, size_t size, char *out)
+{
+	size_t i = 0;
+	for(; i + 16 <= size && decode16(load16(in + i), out); i += 16, out += 12);
+	return i;
+}
+
+TARGET("avx2")
+size_t decodeAVX2(const char *in, size_t size, char *out)
+{
+	size_t i = 0;
+	for(; i + 32 <= size && decode32(load32(in + i), out); i += 32, out += 24);
+	for(; i + 16 <= size && decode16(load16(in + i), out); i += 16, out += 12);
+	return i;
+}
+
+TARGET("avx2")
+size_t decodeAVX2(const ushort *in, size_t size, char *out)
+{
+	size_t i = 0;
+	for(; i + 32 <= size && decode32(load32(in + i), out); i += 32, out += 24);
+	for(; i + 16 <= size && decode16(load16(in + i), out); i += 16, out += 12);
+	return i;
+}
+
+#if defined(_MSC_VER) && !defined(__clang__)
+bool hasSSE41()
+{
+	int info[4] {};
+	__cpuid(info, 1);
+	return info[2] & (1 << 19);
+}
+
+bool hasAVX2()
+{
+	int info[4] {};
+	__cpuid(info, 0);
+	if(info[0] < 7)
+		return false;
+	__cpuid(info, 1);
+	if(!(info[2] & (1 << 27)) || !(info[2] & (1 << 28)) || (_xgetbv(0) & 0x6) != 0x6) // OSXSAVE, AVX, YMM state
+		return false;
+	__cpuidex(info, 7, 0);
+	return info[1] & (1 << 5);
+}
+#else
+bool hasSSE41() { return __builtin_cpu_supports("sse4.1"); }
+bool hasAVX2() { return __builtin_cpu_supports("avx2"); }
+#endif
+#endif
+
+/**
+ * Block decoders and line encoders selected once by CPU features. Decoders consume input in blocks
+ * of 16 or 32 characters as long as the block contains only base64 alphabet and return the number
+ * of characters consumed. Encoders write whole lines of LINE_SIZE characters.
+ */
+struct Kernel
+{
+	Kernel()
+	{
+#ifdef BASE64_X86
+		if(hasAVX2())
+		{
+			bytes = decodeAVX2;
+			words = decodeAVX2;
+			encodeBytes = encodeAVX2<char>;
+			encodeWords = encodeAVX2<ushort>;
+		}
+		else if(hasSSE41())
+		{
+			bytes = decodeSSE;
+			words = decodeSSE;
+			encodeBytes = encodeSSE<char>;
+			encodeWords = encodeSSE<ushort>;
+		}
+#endif
+	}
+
+	size_t operator()(const char *in, size_t size, char *out) const { return bytes(in, size, out); }
+	size_t operator()(const ushort *in, size_t size, char *out) const { return words(in, size, out); }
+	char* encode(const char *in, size_t lines, char *out) const { return encodeBytes(in, lines, out); }
+	ushort* encode(const char *in, size_t lines, ushort *out) const { return encodeWords(in, lines, out); }
+
+	size_t (*bytes)(const char *, size_t, char *) = decodeNone<char>;
+	size_t (*words)(const ushort *, size_t, char *) = decodeNone<ushort>;
+	char* (*encodeBytes)(const char *, size_t, char *) = encodeLines<char>;
+	ushort* (*encodeWords)(const char *, size_t, ushort *) = encodeLines<ushort>;
+};
+
+const Kernel &kernel()
+{
+	static const Kernel kernel;
+	return kernel;
+}
+
+}
+
+char* Base64Decoder::decode(const char *in, const char *end, char *out)
+{
+	return decodeImpl(in, end, out);
+}
+
+char* Base64Decoder::decode(const ushort *in, const ushort *end, char *out)
+{
+	return decodeImpl(in, end, out);
+}
+
+template<typename T>
+char* Base64Decoder::decodeImpl(const T *in, const T *end, char *out)
+{
+	const Kernel &blocks = kernel();
+	while(in != end)
+	{
+		// Vector path works on whole quantums of 4 characters
+		if(nbits == 0 && !entity)
+		{
+			size_t size = blocks(in, size_t(end - in), out);
+			in += size;
+			out += size / 4 * 3;
+		}
+
+		// Continue with scalar path until next quantum boundary
+		for(; in != end; ++in)
+		{
+			uint ch = uint(*in);
+			if(entity)
+			{
+				entity = ch != ';';
+				continue;
+			}
+			qint8 d = ch < 256 ? TABLE.value[ch] : -1;
+			if(d < 0)
+			{
+				entity = ch == '&';
+				if(nbits == 0 && !entity)
+				{
+					++in;
+					break;
+				}
+				continue;
+			}
+			buf = (buf << 6) | uint(d);
+			nbits += 6;
+			if(nbits >= 8)
+			{
+				nbits -= 8;
+				*out++ = char(buf >> nbits);
+				buf &= (1U << nbits) - 1;
+				if(nbits == 0)
+				{
+					++in;
+					break;
+				}
+			}
+		}
+	}
+	return out;
+}
+
+size_t Base64Encoder::encodedSize(size_t size)
+{
+	size_t tail = size % LINE_BYTES;
+	return size / LINE_BYTES * LINE_SIZE + (tail ? (tail + 2) / 3 * 4 + 1 : 0);
+}
+
+char* Base64Encoder::encode(const char *in, size_t size, char *out)
+{
+	return encodeImpl(in, size, out);
+}
+
+ushort* Base64Encoder::encode(const char *in, size_t size, ushort *out)
+{
+	return encodeImpl(in, size, out);
+}
+
+template<typename T>
+T* Base64Encoder::encodeImpl(const char *in, size_t size, T *out)
+{
+	size_t lines = size / LINE_BYTES;
+	out = kernel().encode(in, lines, out);
+	in += lines * LINE_BYTES;
+	size -= lines * LINE_BYTES;
+	if(size == 0)
+		return out;
+	for(size_t i = 0; i < size; i += 3)
+		out = encodeQuantum(in + i, std::min<size_t>(3, size - i), out);
+	*out++ = T('\n');
+	return out;
+}
@@ -0,0 +1,66 @@
+/*
+ * QDigiDocCrypto
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#pragma once
+
+#include <QtCore/QtGlobal>
+
+/**
+ * Incremental base64 decoder.
+ *
+ * Characters outside of the alphabet (line breaks, padding, XML character references) are skipped.
+ * Runs of base64 characters are decoded with SSE4.1 or AVX2 when the CPU supports it.
+ * Input may be split at any position between calls. Output buffer must hold 3/4 of the input size
+ * and up to 2 bytes carried over from the previous call.
+ */
+class Base64Decoder
+{
+public:
+	char* decode(const char *in, const char *end, char *out);
+	char* decode(const ushort *in, const ushort *end, char *out);
+
+private:
+	template<typename T>
+	char* decodeImpl(const T *in, const T *end, char *out);
+
+	uint buf = 0;
+	int nbits = 0;
+	bool entity = false;
+};
+
+/**
+ * Base64 encoder producing lines of 64 characters terminated with '\n', last line is padded.
+ *
+ * Whole lines are encoded with SSE4.1 or AVX2 when the CPU supports it.
+ * Output buffer must hold encodedSize() characters.
+ */
+class Base64Encoder
+{
+public:
+	static constexpr size_t LINE_BYTES = 48;
+	static constexpr size_t LINE_SIZE = 65;
+
+	static size_t encodedSize(size_t size);
+	static char* encode(const char *in, size_t size, char *out);
+	static ushort* encode(const char *in, size_t size, ushort *out);
+
+private:
+	template<typename T>
+	static T* encodeImpl(const char *in, size_t size, T *out);
+};
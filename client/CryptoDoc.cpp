@@ -20,9 +20,11 @@
 #include "CryptoDoc.h"
 
 #include "Application.h"
+#include "Base64.h"
 #include "TokenData.h"
 #include "QSigner.h"
 #include "SslCertificate.h"
+#include "Utils.h"
 #include "dialogs/FileDialog.h"
 #include "dialogs/WarningDialog.h"
 
@@ -30,10 +32,16 @@
 #include <QtCore/QBuffer>
 #include <QtCore/QCryptographicHash>
 #include <QtCore/QDir>
+#include <QtCore/QDirIterator>
+#include <QtCore/QEventLoop>
 #include <QtCore/QFileInfo>
+#include <QtCore/QHash>
+#include <QtCore/QJsonArray>
 #include <QtCore/QLoggingCategory>
 #include <QtCore/QMimeData>
+#include <QtCore/QMimeDatabase>
 #include <QtCore/QRegularExpression>
+#include <QtCore/QSaveFile>
 #include <QtCore/QTemporaryFile>
 #include <QtCore/QtEndian>
 #include <QtCore/QThread>
@@ -52,8 +60,14 @@
 #include <openssl/ecdh.h>
 #include <openssl/x509.h>
 
+#include <zlib.h>
+
+#include <array>
+#include <atomic>
 #include <cmath>
+#include <functional>
 #include <memory>
+#include <mutex>
 
 #if defined(Q_OS_WIN)
 #include <qt_windows.h>
@@ -69,28 +83,61 @@ using pcuchar = const uchar *;
 
 Q_LOGGING_CATEGORY(CRYPTO,"CRYPTO")
 
+constexpr qint64 BLOCK_SIZE = 64 * 1024;
+// Decrypted single file up to this size is kept in memory instead of temporary file
+constexpr qint64 MEMORY_LIMIT = 64 * 1024 * 1024;
+// Maximum compression ratio of deflate, valid zlib payload does not inflate to more
+constexpr qint64 MAX_INFLATE_RATIO = 1032;
+
 class CryptoDoc::Private final: public QThread
 {
 	Q_OBJECT
 public:
 	struct File
 	{
-		QString name, id, mime, size;
+		QString name, id, mime, size, path;
 		QByteArray data;
+		// Base64 encoded content in decrypted DDoc file, decoded when needed
+		QString ddoc;
+		qint64 ddocPos = 0, ddocSize = 0, decodedSize = 0;
+
+		bool decode(const std::function<bool(const char*,qint64)> &f) const;
+		qint64 fileSize() const;
+		bool write(QIODevice *out) const;
 	};
 
-	QByteArray AES_wrap(const QByteArray &key, const QByteArray &data, bool encrypt);
-	QByteArray crypto(const EVP_CIPHER *cipher, const QByteArray &data, bool encrypt);
+	static QByteArray AES_wrap(const QByteArray &key, const QByteArray &data, bool encrypt);
+	// Files to write, directories are replaced with the files they contain
+	QList<File> dataFiles() const;
+	bool decrypt(QIODevice *in, qint64 size, QIODevice *out);
 
 	bool isEncryptedWarning();
+	// Estimates from entropy of the beginning of the files whether compression is worthwhile
+	static bool isCompressible(const QList<File> &entries);
 #if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
 	QByteArray fromBase64(const QStringView &data);
 #else
 	QByteArray fromBase64(const QStringRef &data);
 #endif
 	static bool opensslError(bool err);
-	QByteArray readCDoc(QIODevice *cdoc, bool data);
-	void readDDoc(QIODevice *ddoc);
+	static QByteArray fingerprint(const QByteArray &der)
+	{
+		return QCryptographicHash::hash(der, QCryptographicHash::Sha256);
+	}
+	const CKey* findKey(const QSslCertificate &cert) const
+	{
+		QHash<QByteArray,int>::const_iterator i = keyIndex.constFind(fingerprint(cert.toDer()));
+		return i == keyIndex.constEnd() ? nullptr : &keys.at(i.value());
+	}
+	void indexKey(const QByteArray &der, int i)
+	{
+		QByteArray key = fingerprint(der);
+		if(!keyIndex.contains(key))
+			keyIndex.insert(key, i);
+	}
+	bool readBinary(QIODevice *cdoc);
+	// With headerOnly the payload is not read, only its position is recorded
+	bool readCDoc(QIODevice *cdoc, bool headerOnly = false);
 	void run() final;
 	void setLastError(const QString &err);
 	QString size(const QString &size)
@@ -99,13 +146,22 @@ public:
 		quint64 result = size.toUInt(&converted);
 		return converted ? FileDialog::fileSize(result) : size;
 	}
+	// Cancel flag is cleared when the operation begins, so cancel during PIN entry is not lost
+	inline void reset()
+	{
+		progressDone = progressTotal = 0;
+		progressPercent = -1;
+	}
 	inline void waitForFinished()
 	{
+		reset();
 		QEventLoop e;
 		connect(this, &Private::finished, &e, &QEventLoop::quit);
 		start();
 		e.exec();
 	}
+	bool step(qint64 bytes);
+	bool unwrapKey(const CKey &key);
 	inline void writeAttributes(QXmlStreamWriter &x, const QMap<QString,QString> &attrs)
 	{
 		for(QMap<QString,QString>::const_iterator i = attrs.cbegin(), end = attrs.cend(); i != end; ++i)
@@ -128,8 +184,11 @@ public:
 	}
 	inline void writeBase64(QXmlStreamWriter &x, const QByteArray &data)
 	{
-		for(int i = 0; i < data.size(); i+=48)
-			x.writeCharacters(data.mid(i, 48).toBase64() + "\n");
+		if(data.isEmpty())
+			return;
+		QString text(int(Base64Encoder::encodedSize(size_t(data.size()))), Qt::Uninitialized);
+		Base64Encoder::encode(data.constData(), size_t(data.size()), reinterpret_cast<ushort*>(text.data()));
+		x.writeCharacters(text);
 	}
 	inline void writeBase64Element(QXmlStreamWriter &x, const QString &ns, const QString &name, const QByteArray &data)
 	{
@@ -137,10 +196,24 @@ public:
 		writeBase64(x, data);
 		x.writeEndElement();
 	}
-	void writeCDoc(QIODevice *cdoc, const QByteArray &transportKey, const QByteArray &encryptedData,
-		const QString &file, const QString &ver, const QString &mime);
-	void writeDDoc(QIODevice *ddoc);
-
+	struct WrappedKey
+	{
+		QString method, concatDigest;
+		QByteArray cert, cipher, oid, SsDer;
+	};
+	static bool wrapKey(const CKey &key, const QByteArray &transportKey, const QByteArray &docFormat, WrappedKey &wrapped);
+	static QMultiHash<QString,QString> encryptionProperties(const QString &file, const QString &ver, const QList<File> &entries);
+	bool rekey(QIODevice *cdoc, const QList<CKey> &newKeys);
+	bool writeCDoc(QIODevice *cdoc, const QByteArray &transportKey, const std::function<bool(QXmlStreamWriter&)> &cipherValue,
+		const QMultiHash<QString,QString> &props, const QString &mime);
+	bool writeBinary(QIODevice *cdoc, const QByteArray &transportKey, const std::function<bool(QIODevice*)> &data,
+		const QMultiHash<QString,QString> &props, const QString &mime);
+	// Without content only the markup is written
+	bool writeDDoc(QIODevice *ddoc, const QList<File> &entries, bool content = true);
+	// Size of DDoc written by writeDDoc, computed without encoding the content
+	qint64 ddocSize(const QList<File> &entries);
+
+	static const QByteArray BINARY_MAGIC;
 	static const QString MIME_XML, MIME_ZLIB, MIME_DDOC, MIME_DDOC_OLD;
 	static const QString DS, DENC, DSIG11, XENC11;
 	static const QString AES128CBC_MTH, AES192CBC_MTH, AES256CBC_MTH, AES128GCM_MTH, AES192GCM_MTH, AES256GCM_MTH,
@@ -150,16 +223,35 @@ public:
 	static const QHash<QString, quint32> KWAES_SIZE;
 
 	QString			method, mime, fileName, lastError;
-	QByteArray		key;
+	QByteArray		key, cipherText;
+	qint64			cipherPos = -1, cipherSize = 0;
+	// Binary CDOC: XML header is followed by nonce and AES-GCM encrypted chunks
+	bool			binary = false;
+	QByteArray		chunkNonce, headerDigest;
+	CryptoDoc::EncryptOptions options;
 	QHash<QString,QString> properties;
+	QStringList		origFiles; // orig_file properties as stored in document
 	QList<CKey>		keys;
+	QList<CKey>		newKeys; // When set, run() changes the recipients of the document to these
+	QHash<QByteArray,int> keyIndex; // SHA-256 certificate fingerprint to first index in keys
 	QList<File>		files;
 	bool			hasSignature = false, encrypted = false;
 	CDocumentModel	*documents = nullptr;
-	QTemporaryFile	*ddoc = nullptr;
+	QString			ddoc; // Decrypted DDoc temporary file
 	QStringList		tempFiles;
+	std::atomic<bool> cancelled{false};
+	qint64			progressDone = 0, progressTotal = 0;
+	int				progressPercent = -1;
+
+	class ChunkDevice;
+	class CipherDevice;
+	class DDocReader;
+
+signals:
+	void progress(qint64 done, qint64 total);
 };
 
+const QByteArray CryptoDoc::Private::BINARY_MAGIC = QByteArrayLiteral("\x89" "CDOC\r\n\x1a\n");
 const QString CryptoDoc::Private::MIME_XML = QStringLiteral("text/xml");
 const QString CryptoDoc::Private::MIME_ZLIB = QStringLiteral("http://www.isi.edu/in-noes/iana/assignments/media-types/application/zip");
 const QString CryptoDoc::Private::MIME_DDOC = QStringLiteral("http://www.sk.ee/DigiDoc/v1.3.0/digidoc.xsd");
@@ -194,80 +286,1012 @@ const QHash<QString, QCryptographicHash::Algorithm> CryptoDoc::Private::SHA_MTH{
 };
 const QHash<QString, quint32> CryptoDoc::Private::KWAES_SIZE{{KWAES128_MTH, 16}, {KWAES192_MTH, 24}, {KWAES256_MTH, 32}};
 
-QByteArray CryptoDoc::Private::AES_wrap(const QByteArray &key, const QByteArray &data, bool encrypt)
+namespace {
+
+/**
+ * Read-only view of a CDOC or DDOC document for QXmlStreamReader which leaves out large
+ * base64 encoded payloads. Position and size of the skipped text are recorded and the text
+ * is replaced with a "@<index>" placeholder, so the payload can be streamed directly from
+ * the source later.
+ * When the closing tag and depth of the payload element are given, only text directly inside
+ * that element is skipped, other large text is passed through. If the device is random access,
+ * the end of the payload is looked up backwards from the end of the document,
+ * so the payload is not read at all.
+ * With headerOnly the payload is skipped as soon as its start tag is seen, so only the markup
+ * before and after the payload is read from the device.
+ * Without device the document is pushed to the filter in chunks, which is used to parse DDoc
+ * while it is being decrypted.
+ */
+class PayloadFilter final: public QIODevice
 {
-	QByteArray result;
-	AES_KEY aes = {};
-	if(0 != (encrypt ?
-		AES_set_encrypt_key(pcuchar(key.data()), key.length() * 8, &aes) :
-		AES_set_decrypt_key(pcuchar(key.data()), key.length() * 8, &aes)))
+public:
+	struct Run
+	{
+		qint64 pos, size;
+		// Count of base64 alphabet characters in the run when it is read, decoded size is chars * 3 / 4
+		qint64 chars;
+	};
+
+	explicit PayloadFilter(QIODevice *io, QByteArray endTag = {}, int payloadDepth = 0, bool headerOnly = false)
+		: io(io)
+		, endTag(std::move(endTag))
+		, payloadDepth(payloadDepth)
+		, headerOnly(headerOnly)
+	{
+		open(QIODevice::ReadOnly);
+	}
+
+	bool atEnd() const final { return eof && ready.isEmpty(); }
+	bool isSequential() const final { return true; }
+
+	const Run* skippedRun(const QString &text) const
+	{
+		if(!text.startsWith('@'))
+			return nullptr;
+		bool ok = false;
+		int i = text.mid(1).toInt(&ok);
+		return ok && i >= 0 && i < runs.size() ? &runs.at(i) : nullptr;
+	}
+
+	/**
+	 * Filters the next chunk of the document when the filter has no device and returns the output.
+	 * Empty chunk marks the end of the document.
+	 */
+	QByteArray push(const QByteArray &chunk)
+	{
+		if(chunk.isEmpty())
+			finish(pushed);
+		else
+			process(chunk, pushed);
+		pushed += chunk.size();
+		QByteArray result;
+		result.swap(ready);
 		return result;
-	result.resize(data.size() + 8);
-	int size = encrypt ?
-		AES_wrap_key(&aes, nullptr, puchar(result.data()), pcuchar(data.data()), uint(data.size())) :
-		AES_unwrap_key(&aes, nullptr, puchar(result.data()), pcuchar(data.data()), uint(data.size()));
-	if(size > 0)
+	}
+
+private:
+	enum State
+	{
+		Markup,
+		Text,
+		Plain,
+		Skip
+	};
+
+	static bool isBase64(char c)
+	{
+		return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') ||
+			c == '+' || c == '/' || c == '=' || c == '\n' || c == '\r' || c == ' ' || c == '\t' ||
+			c == '&' || c == '#' || c == ';';
+	}
+
+	/**
+	 * Finds the end tag closing the payload which starts at given position.
+	 * In CDOC only EncryptionProperties follow the payload, so the last CipherValue tag in the document is searched.
+	 */
+	qint64 findPayloadEnd(qint64 from) const
+	{
+		static const int OVERLAP = 256;
+		QByteArray data;
+		for(qint64 pos = io->size(); pos > from;)
+		{
+			qint64 size = qMin<qint64>(BLOCK_SIZE, pos - from);
+			pos -= size;
+			if(!io->seek(pos))
+				return -1;
+			QByteArray block = io->read(size);
+			if(block.size() != size)
+				return -1;
+			data = block + data.left(OVERLAP);
+			for(int i = data.lastIndexOf(endTag); i >= 0; i = data.lastIndexOf(endTag, i - 1))
+			{
+				// Back up over namespace prefix to '</'
+				int begin = i;
+				for(; begin > 0 && !strchr("</> \t\r\n", data[begin - 1]); --begin);
+				if(begin < 2)
+					break; // Continue with previous block
+				if(data[begin - 2] == '<' && data[begin - 1] == '/' && (begin == i || (data[i - 1] == ':' && begin < i - 1)))
+					return pos + begin - 2;
+			}
+		}
+		return -1;
+	}
+
+	/**
+	 * Tracks element depth with the completed tag, returns true when it is the start tag of the payload.
+	 * The following text is inside the payload until the next tag.
+	 */
+	bool isPayloadStart()
+	{
+		const QByteArray t = tag;
+		tag.clear();
+		inPayload = false;
+		if(t.startsWith("</"))
+		{
+			--depth;
+			return false;
+		}
+		if(t.startsWith("<?") || t.startsWith("<!") || t.endsWith("/>"))
+			return false;
+		if(++depth != payloadDepth)
+			return false;
+		int nameEnd = 1;
+		for(; nameEnd < t.size() && !strchr(" \t\r\n/>", t[nameEnd]); ++nameEnd);
+		QByteArray name = t.mid(1, nameEnd - 1);
+		name = name.mid(name.lastIndexOf(':') + 1) + '>';
+		return inPayload = name == endTag;
+	}
+
+	void count(const char *i, const char *end)
+	{
+		for(; i != end; ++i)
+		{
+			if(entity)
+				entity = *i != ';';
+			else if(*i == '&')
+				entity = true;
+			else if(*i != '=' && *i != '#' && *i != ';' && *i != ' ' && *i != '\t' && *i != '\r' && *i != '\n')
+				++chars;
+		}
+	}
+
+	void skipped(qint64 end)
+	{
+		runs.last().size = end - runs.last().pos;
+		runs.last().chars = chars;
+		state = Markup;
+	}
+
+	bool fill()
+	{
+		const qint64 chunkPos = io->pos();
+		const QByteArray chunk = io->read(headerOnly ? HEADER_BLOCK_SIZE : BLOCK_SIZE);
+		if(!chunk.isEmpty())
+			return process(chunk, chunkPos);
+		finish(chunkPos);
+		return false;
+	}
+
+	void finish(qint64 pos)
+	{
+		if(state == Skip)
+			skipped(pos);
+		ready += run;
+		run.clear();
+		eof = true;
+	}
+
+	bool process(const QByteArray &chunk, qint64 chunkPos)
+	{
+		const char *begin = chunk.constData(), *i = begin, *end = begin + chunk.size();
+		while(i != end)
+		{
+			switch(state)
+			{
+			case Markup:
+				if(const char *p = static_cast<const char*>(memchr(i, '>', size_t(end - i))))
+				{
+					ready.append(i, int(p - i + 1));
+					if(payloadDepth > 0)
+						tag.append(i, int(p - i + 1));
+					i = p + 1;
+					runPos = chunkPos + (i - begin);
+					chars = 0;
+					entity = false;
+					state = Text;
+					if(payloadDepth <= 0 || !isPayloadStart() || !headerOnly)
+						break;
+					ready += '@' + QByteArray::number(runs.size());
+					runs.append({runPos, 0, 0});
+					state = Skip;
+					qint64 payloadEnd = io->isSequential() ? -1 : findPayloadEnd(runPos);
+					if(payloadEnd < 0 || !io->seek(payloadEnd))
+					{
+						io->seek(chunkPos + chunk.size());
+						break;
+					}
+					skipped(payloadEnd);
+					return true;
+				}
+				else
+				{
+					ready.append(i, int(end - i));
+					if(payloadDepth > 0)
+						tag.append(i, int(end - i));
+					i = end;
+				}
+				break;
+			case Text:
+			{
+				const char *p = i;
+				for(; p != end && isBase64(*p); ++p);
+				run.append(i, int(p - i));
+				count(i, p);
+				i = p;
+				if(run.size() > THRESHOLD && (payloadDepth <= 0 || inPayload))
+				{
+					ready += '@' + QByteArray::number(runs.size());
+					runs.append({runPos, 0, 0});
+					run.clear();
+					state = Skip;
+					if(endTag.isEmpty() || !io || io->isSequential())
+						break;
+					qint64 payloadEnd = findPayloadEnd(chunkPos + (i - begin));
+					if(payloadEnd < 0 || !io->seek(payloadEnd))
+					{
+						io->seek(chunkPos + chunk.size());
+						break;
+					}
+					skipped(payloadEnd);
+					return true;
+				}
+				else if(i != end || run.size() > THRESHOLD)
+				{
+					// Large text outside of the payload is passed through
+					ready += run;
+					run.clear();
+					if(i != end)
+						state = *i == '<' ? Markup : Plain;
+				}
+				break;
+			}
+			case Plain:
+			case Skip:
+				if(const char *p = static_cast<const char*>(memchr(i, '<', size_t(end - i))))
+				{
+					if(state == Plain)
+						ready.append(i, int(p - i));
+					else
+					{
+						count(i, p);
+						skipped(chunkPos + (p - begin));
+					}
+					i = p;
+					state = Markup;
+				}
+				else
+				{
+					if(state == Plain)
+						ready.append(i, int(end - i));
+					else
+						count(i, end);
+					i = end;
+				}
+				break;
+			}
+		}
+		return true;
+	}
+
+	qint64 readData(char *data, qint64 maxlen) final
+	{
+		while(ready.isEmpty() && fill()) {}
+		qint64 size = qMin<qint64>(maxlen, ready.size());
+		memcpy(data, ready.constData(), size_t(size));
+		ready.remove(0, int(size));
+		return size;
+	}
+
+	qint64 writeData(const char * /*data*/, qint64 /*len*/) final { return -1; }
+
+	static const int THRESHOLD = 64 * 1024;
+	static const int HEADER_BLOCK_SIZE = 8 * 1024;
+	QIODevice *io;
+	QByteArray endTag, ready, run, tag;
+	QVector<Run> runs;
+	qint64 runPos = 0, chars = 0, pushed = 0;
+	int payloadDepth, depth = 0;
+	State state = Plain;
+	bool headerOnly, inPayload = false, entity = false, eof = false;
+};
+
+/**
+ * Write-only device which writes data as base64 encoded XML character data, 64 characters per line.
+ * Input is collected to a fixed size buffer and encoded to a reused string, so the XML writer
+ * receives large slices without per line allocations.
+ */
+class Base64Writer final: public QIODevice
+{
+public:
+	explicit Base64Writer(QXmlStreamWriter &x)
+		: x(x)
+		, buffer(CHUNK_SIZE, Qt::Uninitialized)
+	{
+		open(QIODevice::WriteOnly);
+	}
+
+	bool isSequential() const final { return true; }
+
+	bool finalize()
+	{
+		flushBuffer();
+		return !x.hasError();
+	}
+
+private:
+	// Multiple of Base64Encoder::LINE_BYTES
+	static constexpr int CHUNK_SIZE = 48 * 1024;
+
+	void flushBuffer()
+	{
+		if(bufferSize == 0)
+			return;
+		text.resize(int(Base64Encoder::encodedSize(size_t(bufferSize))));
+		Base64Encoder::encode(buffer.constData(), size_t(bufferSize), reinterpret_cast<ushort*>(text.data()));
+		x.writeCharacters(text);
+		bufferSize = 0;
+	}
+
+	qint64 readData(char * /*data*/, qint64 /*maxlen*/) final { return -1; }
+
+	qint64 writeData(const char *data, qint64 len) final
+	{
+		for(qint64 pos = 0; pos < len;)
+		{
+			int size = int(qMin<qint64>(len - pos, CHUNK_SIZE - bufferSize));
+			memcpy(buffer.data() + bufferSize, data + pos, size_t(size));
+			bufferSize += size;
+			pos += size;
+			if(bufferSize == CHUNK_SIZE)
+				flushBuffer();
+		}
+		return x.hasError() ? -1 : len;
+	}
+
+	QXmlStreamWriter &x;
+	QByteArray buffer;
+	QString text;
+	int bufferSize = 0;
+};
+
+/**
+ * Write-only device which inflates zlib compressed data and forwards the result to the next device.
+ * Fails when the inflated data exceeds the limit.
+ */
+class InflateDevice final: public QIODevice
+{
+public:
+	explicit InflateDevice(QIODevice *out, qint64 limit)
+		: out(out)
+		, limit(limit)
+		, buffer(int(BLOCK_SIZE), Qt::Uninitialized)
+	{
+		ok = inflateInit(&z) == Z_OK;
+		open(QIODevice::WriteOnly);
+	}
+
+	~InflateDevice() final
+	{
+		inflateEnd(&z);
+	}
+
+	bool isSequential() const final { return true; }
+
+	bool finalize()
+	{
+		if(ok && !end)
+			qCWarning(CRYPTO) << "Compressed stream is truncated";
+		return ok && end;
+	}
+
+private:
+	qint64 readData(char * /*data*/, qint64 /*maxlen*/) final { return -1; }
+
+	qint64 writeData(const char *data, qint64 len) final
+	{
+		z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+		z.avail_in = uInt(len);
+		while(ok && !end)
+		{
+			z.next_out = reinterpret_cast<Bytef*>(buffer.data());
+			z.avail_out = uInt(buffer.size());
+			int rc = inflate(&z, Z_NO_FLUSH);
+			if(rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR)
+			{
+				qCWarning(CRYPTO) << "Failed to decompress data" << (z.msg ? z.msg : "");
+				ok = false;
+				break;
+			}
+			end = rc == Z_STREAM_END;
+			qint64 size = buffer.size() - qint64(z.avail_out);
+			if((total += size) > limit)
+			{
+				qCWarning(CRYPTO) << "Decompressed data exceeds" << limit << "bytes";
+				ok = false;
+				break;
+			}
+			if(size > 0 && out->write(buffer.constData(), size) != size)
+				ok = false;
+			if(z.avail_in == 0 && z.avail_out > 0)
+				break;
+		}
+		return ok ? len : -1;
+	}
+
+	QIODevice *out;
+	qint64 limit, total = 0;
+	QByteArray buffer;
+	z_stream z {};
+	bool ok = false, end = false;
+};
+
+/**
+ * Write-only device which compresses data to zlib stream and forwards it to the next device.
+ */
+class DeflateDevice final: public QIODevice
+{
+public:
+	explicit DeflateDevice(QIODevice *out)
+		: out(out)
+		, buffer(int(BLOCK_SIZE), Qt::Uninitialized)
+	{
+		ok = deflateInit(&z, Z_DEFAULT_COMPRESSION) == Z_OK;
+		open(QIODevice::WriteOnly);
+	}
+
+	~DeflateDevice() final
+	{
+		deflateEnd(&z);
+	}
+
+	bool isSequential() const final { return true; }
+
+	bool finalize()
+	{
+		z.next_in = nullptr;
+		z.avail_in = 0;
+		return compress(Z_FINISH);
+	}
+
+private:
+	bool compress(int flush)
+	{
+		do
+		{
+			z.next_out = reinterpret_cast<Bytef*>(buffer.data());
+			z.avail_out = uInt(buffer.size());
+			if(!ok || deflate(&z, flush) == Z_STREAM_ERROR)
+			{
+				qCWarning(CRYPTO) << "Failed to compress data" << (z.msg ? z.msg : "");
+				return ok = false;
+			}
+			qint64 size = buffer.size() - qint64(z.avail_out);
+			if(size > 0 && out->write(buffer.constData(), size) != size)
+				return ok = false;
+		} while(z.avail_out == 0);
+		return true;
+	}
+
+	qint64 readData(char * /*data*/, qint64 /*maxlen*/) final { return -1; }
+
+	qint64 writeData(const char *data, qint64 len) final
+	{
+		z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+		z.avail_in = uInt(len);
+		return compress(Z_NO_FLUSH) ? len : -1;
+	}
+
+	QIODevice *out;
+	QByteArray buffer;
+	z_stream z {};
+	bool ok = false;
+};
+
+/**
+ * Write-only pass-through device which reports the amount of data written to the next device.
+ * Writing fails when the callback returns false.
+ */
+class ProgressDevice final: public QIODevice
+{
+public:
+	ProgressDevice(QIODevice *out, std::function<bool(qint64)> step)
+		: out(out)
+		, step(std::move(step))
+	{
+		open(QIODevice::WriteOnly);
+	}
+
+	bool isSequential() const final { return true; }
+
+private:
+	qint64 readData(char * /*data*/, qint64 /*maxlen*/) final { return -1; }
+
+	qint64 writeData(const char *data, qint64 len) final
+	{
+		return step(len) ? out->write(data, len) : -1;
+	}
+
+	QIODevice *out;
+	std::function<bool(qint64)> step;
+};
+
+}
+
+/**
+ * Write-only device which encrypts or decrypts the CDOC payload and forwards the result to the next device.
+ * IV is stored at the beginning of the encrypted stream and GCM tag at the end of the stream.
+ *
+ * CBC decryption of a block depends only on the previous ciphertext block, so the stream is collected
+ * into batches which are split into segments and decrypted concurrently.
+ */
+class CryptoDoc::Private::CipherDevice final: public QIODevice
+{
+public:
+	CipherDevice(const EVP_CIPHER *cipher, const QByteArray &key, bool encrypt, bool ansix923, QIODevice *out)
+		: cipher(cipher)
+		, key(key)
+		, out(out)
+		, tagSize(EVP_CIPHER_mode(cipher) == EVP_CIPH_GCM_MODE ? 16 : 0)
+		, encrypt(encrypt)
+		, ansix923(ansix923)
+		, parallel(!encrypt && EVP_CIPHER_mode(cipher) == EVP_CIPH_CBC_MODE)
+	{
+		open(QIODevice::WriteOnly);
+	}
+
+	bool isSequential() const final { return true; }
+
+	bool finalize()
+	{
+		if(encrypt)
+		{
+			if(!ctx && !start())
+				return false;
+			if(ansix923)
+			{
+				QByteArray padding(int(16 - (total % 16)), 0);
+				qCDebug(CRYPTO) << "Adding ANSIX923 padding size" << padding.size();
+				padding[padding.size() - 1] = char(padding.size());
+				if(!update(padding.constData(), padding.size()))
+					return false;
+			}
+		}
+		else if(!ctx)
+			return false;
+		else if(parallel)
+		{
+			if(!buffer.isEmpty() && !update(buffer.constData(), buffer.size()))
+				return false;
+			buffer.clear();
+		}
+		else if(buffer.size() != tagSize)
+			return false;
+		else if(tagSize > 0 && opensslError(EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_SET_TAG, tagSize, buffer.data()) <= 0))
+			return false;
+
+		int size = 0;
+		result.resize(EVP_CIPHER_CTX_block_size(ctx.get()));
+		if(opensslError(EVP_CipherFinal(ctx.get(), puchar(result.data()), &size) <= 0) ||
+			!forward(result.constData(), size))
+			return false;
+
+		if(encrypt)
+		{
+			if(tagSize == 0)
+				return true;
+			QByteArray tag(tagSize, 0);
+			return !opensslError(EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_GET_TAG, tagSize, tag.data()) <= 0) &&
+				out->write(tag) == tag.size();
+		}
+
+		// remove ANSIX923 padding
+		if(ansix923 && !tail.isEmpty())
+		{
+			int padSize = uchar(tail.at(tail.size() - 1));
+			QByteArray padding(padSize, 0);
+			if(padSize > 0 && padSize <= tail.size())
+			{
+				padding[padSize - 1] = char(padSize);
+				if(tail.endsWith(padding))
+				{
+					qCDebug(CRYPTO) << "Removing ANSIX923 padding size:" << padSize;
+					tail.chop(padSize);
+				}
+			}
+		}
+		return out->write(tail) == tail.size();
+	}
+
+private:
+	static constexpr int SEGMENT_SIZE = 512 * 1024;
+	static constexpr int BATCH_SIZE = 16 * SEGMENT_SIZE;
+
+	bool init(const QByteArray &iv)
+	{
+		chain = iv;
+		ctx.reset(EVP_CIPHER_CTX_new());
+		if(opensslError(!ctx) ||
+			opensslError(EVP_CipherInit(ctx.get(), cipher, pcuchar(key.constData()), pcuchar(iv.constData()), encrypt) <= 0))
+		{
+			ctx.reset();
+			return false;
+		}
+		return true;
+	}
+
+	bool start()
+	{
+		QByteArray iv(EVP_CIPHER_iv_length(cipher), 0);
+		return !opensslError(RAND_bytes(puchar(iv.data()), iv.size()) <= 0) &&
+			init(iv) && out->write(iv) == iv.size();
+	}
+
+	bool update(const char *data, int size)
+	{
+		int resultSize = 0;
+		result.resize(size + EVP_CIPHER_CTX_block_size(ctx.get()));
+		return !opensslError(EVP_CipherUpdate(ctx.get(), puchar(result.data()), &resultSize, pcuchar(data), size) <= 0) &&
+			forward(result.constData(), resultSize);
+	}
+
+	// Decrypts first size bytes of buffer, size must be multiple of the block size
+	bool updateParallel(int size)
+	{
+		const int blockSize = EVP_CIPHER_block_size(cipher);
+		const int segments = (size + SEGMENT_SIZE - 1) / SEGMENT_SIZE;
 		result.resize(size);
-	else
-		result.clear();
-	return result;
+		const char *in = buffer.constData();
+		char *dst = result.data();
+		std::atomic<bool> ok{true};
+		parallelFor(segments, [&](int i) {
+			int pos = i * SEGMENT_SIZE;
+			int len = qMin(SEGMENT_SIZE, size - pos);
+			const char *iv = i == 0 ? chain.constData() : in + pos - blockSize;
+			auto segment = SCOPE(EVP_CIPHER_CTX, EVP_CIPHER_CTX_new());
+			int resultSize = 0;
+			if(opensslError(!segment) ||
+				opensslError(EVP_DecryptInit(segment.get(), cipher, pcuchar(key.constData()), pcuchar(iv)) <= 0) ||
+				opensslError(EVP_CIPHER_CTX_set_padding(segment.get(), 0) <= 0) ||
+				opensslError(EVP_DecryptUpdate(segment.get(), puchar(dst + pos), &resultSize, pcuchar(in + pos), len) <= 0) ||
+				resultSize != len)
+				ok = false;
+		});
+		// continue the sequential context from the last decrypted ciphertext block
+		return ok && forward(result.constData(), size) && init(buffer.mid(size - blockSize, blockSize));
+	}
+
+	bool forward(const char *data, int size)
+	{
+		if(encrypt || !ansix923)
+			return out->write(data, size) == size;
+		// hold back last block until padding can be checked
+		int n = tail.size() + size - 16;
+		if(n <= 0)
+		{
+			tail.append(data, size);
+			return true;
+		}
+		int fromTail = qMin(n, tail.size());
+		if(out->write(tail.constData(), fromTail) != fromTail)
+			return false;
+		tail.remove(0, fromTail);
+		int fromData = n - fromTail;
+		if(out->write(data, fromData) != fromData)
+			return false;
+		tail.append(data + fromData, size - fromData);
+		return true;
+	}
+
+	qint64 readData(char * /*data*/, qint64 /*maxlen*/) final { return -1; }
+
+	qint64 writeData(const char *data, qint64 len) final
+	{
+		if(encrypt)
+		{
+			if(!ctx && !start())
+				return -1;
+			total += len;
+			return update(data, int(len)) ? len : -1;
+		}
+
+		buffer.append(data, int(len));
+		if(!ctx)
+		{
+			int ivSize = EVP_CIPHER_iv_length(cipher);
+			if(buffer.size() < ivSize)
+				return len;
+			if(!init(buffer.left(ivSize)))
+				return -1;
+			buffer.remove(0, ivSize);
+		}
+
+		if(parallel)
+		{
+			// keep the last block for finalize() to check the padding
+			if(buffer.size() <= BATCH_SIZE)
+				return len;
+			int blockSize = EVP_CIPHER_block_size(cipher);
+			int size = (buffer.size() - 1) / blockSize * blockSize;
+			if(!updateParallel(size))
+				return -1;
+			buffer.remove(0, size);
+			return len;
+		}
+
+		int size = buffer.size() - tagSize;
+		if(size <= 0)
+			return len;
+		if(!update(buffer.constData(), size))
+			return -1;
+		buffer.remove(0, size);
+		return len;
+	}
+
+	const EVP_CIPHER *cipher;
+	QByteArray key, buffer, result, tail, chain;
+	QIODevice *out;
+	std::unique_ptr<EVP_CIPHER_CTX,decltype(&EVP_CIPHER_CTX_free)> ctx{nullptr, EVP_CIPHER_CTX_free};
+	qint64 total = 0;
+	const int tagSize;
+	const bool encrypt, ansix923, parallel;
+};
+
+/**
+ * Write-only device for the payload of binary CDOC. Payload is split into chunks of CHUNK_SIZE bytes,
+ * each chunk is encrypted separately with AES-GCM and followed by its tag.
+ * Chunk nonce is the base nonce XOR-ed with the chunk index. Additional authenticated data binds
+ * the chunk to the header digest, chunk index and last chunk flag, so reordering or truncating fails.
+ */
+class CryptoDoc::Private::ChunkDevice final: public QIODevice
+{
+public:
+	static constexpr int CHUNK_SIZE = 1024 * 1024;
+	static constexpr int NONCE_SIZE = 12;
+	static constexpr int TAG_SIZE = 16;
+
+	ChunkDevice(const EVP_CIPHER *cipher, const QByteArray &key, const QByteArray &nonce, const QByteArray &headerDigest,
+			bool encrypt, QIODevice *out)
+		: cipher(cipher)
+		, key(key)
+		, nonce(nonce)
+		, headerDigest(headerDigest)
+		, out(out)
+		, encrypt(encrypt)
+	{
+		open(QIODevice::WriteOnly);
+	}
+
+	bool isSequential() const final { return true; }
+
+	bool finalize()
+	{
+		if(!encrypt && buffer.size() < TAG_SIZE)
+			return false;
+		return process(buffer.constData(), buffer.size(), true);
+	}
+
+private:
+	bool process(const char *data, int size, bool last)
+	{
+		QByteArray iv = nonce;
+		for(int i = 0; i < 8; ++i)
+			iv[NONCE_SIZE - 1 - i] = char(iv.at(NONCE_SIZE - 1 - i) ^ char(index >> (8 * i)));
+		QByteArray aad = headerDigest;
+		aad.resize(headerDigest.size() + 9);
+		qToBigEndian<quint64>(index, aad.data() + headerDigest.size());
+		aad[aad.size() - 1] = char(last);
+		++index;
+
+		const int len = encrypt ? size : size - TAG_SIZE;
+		int resultSize = 0, finalSize = 0;
+		result.resize(len + TAG_SIZE);
+		auto ctx = SCOPE(EVP_CIPHER_CTX, EVP_CIPHER_CTX_new());
+		if(opensslError(!ctx) ||
+			opensslError(EVP_CipherInit_ex(ctx.get(), cipher, nullptr, nullptr, nullptr, encrypt) <= 0) ||
+			opensslError(EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_SET_IVLEN, NONCE_SIZE, nullptr) <= 0) ||
+			opensslError(EVP_CipherInit_ex(ctx.get(), nullptr, nullptr, pcuchar(key.constData()), pcuchar(iv.constData()), encrypt) <= 0) ||
+			opensslError(EVP_CipherUpdate(ctx.get(), nullptr, &resultSize, pcuchar(aad.constData()), aad.size()) <= 0) ||
+			opensslError(EVP_CipherUpdate(ctx.get(), puchar(result.data()), &resultSize, pcuchar(data), len) <= 0))
+			return false;
+		if(!encrypt && opensslError(EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_SET_TAG, TAG_SIZE, const_cast<char*>(data + len)) <= 0))
+			return false;
+		if(opensslError(EVP_CipherFinal_ex(ctx.get(), puchar(result.data()) + resultSize, &finalSize) <= 0))
+			return false;
+		if(!encrypt)
+			return out->write(result.constData(), len) == len;
+		return !opensslError(EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_GET_TAG, TAG_SIZE, result.data() + len) <= 0) &&
+			out->write(result.constData(), len + TAG_SIZE) == len + TAG_SIZE;
+	}
+
+	qint64 readData(char * /*data*/, qint64 /*maxlen*/) final { return -1; }
+
+	qint64 writeData(const char *data, qint64 len) final
+	{
+		buffer.append(data, int(len));
+		// last chunk is kept for finalize() to mark it
+		const int recordSize = encrypt ? CHUNK_SIZE : CHUNK_SIZE + TAG_SIZE;
+		int pos = 0;
+		for(; buffer.size() - pos > recordSize; pos += recordSize)
+		{
+			if(!process(buffer.constData() + pos, recordSize, false))
+				return -1;
+		}
+		buffer.remove(0, pos);
+		return len;
+	}
+
+	const EVP_CIPHER *cipher;
+	QByteArray key, nonce, headerDigest, buffer, result;
+	QIODevice *out;
+	quint64 index = 0;
+	const bool encrypt;
+};
+
+bool CryptoDoc::Private::File::decode(const std::function<bool(const char*,qint64)> &f) const
+{
+	QFile file(ddoc);
+	if(!file.open(QFile::ReadOnly) || !file.seek(ddocPos))
+		return false;
+	Base64Decoder base64;
+	QByteArray in(int(BLOCK_SIZE), Qt::Uninitialized), buf(int(BLOCK_SIZE), Qt::Uninitialized);
+	for(qint64 pos = 0; pos < ddocSize;)
+	{
+		qint64 size = file.read(in.data(), qMin(BLOCK_SIZE, ddocSize - pos));
+		if(size <= 0)
+			return false;
+		pos += size;
+		const char *end = base64.decode(in.constData(), in.constData() + size, buf.data());
+		if(!f(buf.constData(), end - buf.constData()))
+			return false;
+	}
+	return true;
 }
 
-QByteArray CryptoDoc::Private::crypto(const EVP_CIPHER *cipher, const QByteArray &data, bool encrypt)
+qint64 CryptoDoc::Private::File::fileSize() const
 {
-	QByteArray iv, _data, tag;
-	if(encrypt)
+	if(!path.isEmpty())
+		return QFileInfo(path).size();
+	if(!ddoc.isEmpty())
+		return decodedSize;
+	return data.size();
+}
+
+bool CryptoDoc::Private::File::write(QIODevice *out) const
+{
+	if(!ddoc.isEmpty())
+		return decode([out](const char *data, qint64 size) { return out->write(data, size) == size; });
+	if(path.isEmpty())
+		return out->write(data) == data.size();
+	QFile f(path);
+	if(!f.open(QFile::ReadOnly))
+		return false;
+	QByteArray buf(int(BLOCK_SIZE), Qt::Uninitialized);
+	for(qint64 size = 0; (size = f.read(buf.data(), buf.size())) > 0;)
 	{
-#ifdef WIN32
-		RAND_poll();
-#else
-		RAND_load_file("/dev/urandom", 1024);
-#endif
-		_data = data;
-		iv.resize(EVP_CIPHER_iv_length(cipher));
-		key.resize(EVP_CIPHER_key_length(cipher));
-		uchar salt[PKCS5_SALT_LEN], indata[128];
-		RAND_bytes(salt, sizeof(salt));
-		RAND_bytes(indata, sizeof(indata));
-		if(opensslError(EVP_BytesToKey(cipher, EVP_sha256(), salt, indata, sizeof(indata),
-				1, puchar(key.data()), puchar(iv.data())) <= 0))
-			return {};
+		if(out->write(buf.constData(), size) != size)
+			return false;
 	}
-	else
+	return f.atEnd();
+}
+
+/**
+ * Write-only device which stores decrypted DDoc to a file and parses it while it is written.
+ * Large DataFile content is not kept in memory, files refer to its position in the stored DDoc.
+ */
+class CryptoDoc::Private::DDocReader final: public QIODevice
+{
+public:
+	explicit DDocReader(QFile *ddoc)
+		: ddoc(ddoc)
 	{
-		iv = data.left(EVP_CIPHER_iv_length(cipher));
-		if(EVP_CIPHER_mode(cipher) == EVP_CIPH_GCM_MODE)
-			tag = data.right(16);
-		_data = data.mid(iv.size(), data.size() - iv.size() - tag.size());
+		open(QIODevice::WriteOnly);
 	}
 
-	auto ctx = SCOPE(EVP_CIPHER_CTX, EVP_CIPHER_CTX_new());
-	if(opensslError(EVP_CipherInit(ctx.get(), cipher, pcuchar(key.constData()), pcuchar(iv.constData()), encrypt) <= 0))
-		return {};
+	void finalize(CryptoDoc::Private *d)
+	{
+		x.addData(filter.push({}));
+		parse();
+		d->files = files;
+		d->hasSignature = hasSignature;
+		qCDebug(CRYPTO) << "Container contains signature" << hasSignature;
+	}
 
-	int size = 0;
-	QByteArray result(_data.size() + EVP_CIPHER_CTX_block_size(ctx.get()), Qt::Uninitialized);
-	puchar resultPointer = puchar(result.data()); //Detach only once
-	if(opensslError(EVP_CipherUpdate(ctx.get(), resultPointer, &size, pcuchar(_data.constData()), _data.size()) <= 0))
-		return {};
+private:
+	void parse()
+	{
+		while(!stopped && !x.atEnd())
+		{
+			switch(x.readNext())
+			{
+			case QXmlStreamReader::StartElement:
+				if(x.name() == QStringLiteral("DataFile"))
+				{
+					file = File();
+					file.name = x.attributes().value(QStringLiteral("Filename")).toString().normalized(QString::NormalizationForm_C);
+					file.id = x.attributes().value(QStringLiteral("Id")).toString().normalized(QString::NormalizationForm_C);
+					file.mime = x.attributes().value(QStringLiteral("MimeType")).toString().normalized(QString::NormalizationForm_C);
+					size = x.attributes().value(QStringLiteral("Size")).toULongLong(&hasSize);
+					text.clear();
+					inDataFile = true;
+				}
+				else if(x.name() == QStringLiteral("Signature"))
+					hasSignature = true;
+				break;
+			case QXmlStreamReader::Characters:
+				// Text may be reported in several parts when the data is added incrementally
+				if(inDataFile)
+					text += x.text().toLatin1();
+				break;
+			case QXmlStreamReader::EndElement:
+				if(inDataFile && x.name() == QStringLiteral("DataFile"))
+					addFile();
+				break;
+			case QXmlStreamReader::DTD:
+				qCWarning(CRYPTO) << "XML DTD Declarations are not supported";
+				stopped = true;
+				break;
+			case QXmlStreamReader::EntityReference:
+				qCWarning(CRYPTO) << "XML ENTITY References are not supported";
+				stopped = true;
+				break;
+			default: break;
+			}
+		}
+	}
+
+	void addFile()
+	{
+		inDataFile = false;
+		// Large content is decoded from the DDoc file when the file is opened or saved
+		if(const PayloadFilter::Run *run = filter.skippedRun(QString::fromLatin1(text)))
+		{
+			file.ddoc = ddoc->fileName();
+			file.ddocPos = run->pos;
+			file.ddocSize = run->size;
+			file.decodedSize = run->chars * 3 / 4;
+		}
+		else
+		{
+			file.data.resize(text.size() * 3 / 4);
+			const char *end = Base64Decoder().decode(text.constData(), text.constData() + text.size(), file.data.data());
+			file.data.truncate(int(end - file.data.constData()));
+			hasSize = false;
+		}
+		text.clear();
+		file.size = FileDialog::fileSize(hasSize ? size : quint64(file.fileSize()));
+		files << file;
+	}
 
-	if(!encrypt && EVP_CIPHER_mode(cipher) == EVP_CIPH_GCM_MODE)
-		EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_SET_TAG, tag.size(), tag.data());
+	qint64 readData(char * /*data*/, qint64 /*maxlen*/) final { return -1; }
 
-	int size2 = 0;
-	if(opensslError(EVP_CipherFinal(ctx.get(), resultPointer + size, &size2) <= 0))
-		return {};
-	result.resize(size + size2);
-	if(encrypt)
+	qint64 writeData(const char *data, qint64 len) final
 	{
-		result.prepend(iv);
-		if(EVP_CIPHER_mode(cipher) == EVP_CIPH_GCM_MODE)
+		if(ddoc->write(data, len) != len)
+			return -1;
+		if(!stopped)
 		{
-			tag = QByteArray(16, 0);
-			EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_GET_TAG, tag.size(), tag.data());
-			result.append(tag);
+			x.addData(filter.push(QByteArray::fromRawData(data, int(len))));
+			parse();
 		}
+		return len;
 	}
+
+	QFile *ddoc;
+	PayloadFilter filter {nullptr};
+	QXmlStreamReader x;
+	QList<File> files;
+	File file;
+	QByteArray text;
+	quint64 size = 0;
+	bool hasSize = false, hasSignature = false, inDataFile = false, stopped = false;
+};
+
+QByteArray CryptoDoc::Private::AES_wrap(const QByteArray &key, const QByteArray &data, bool encrypt)
+{
+	QByteArray result;
+	AES_KEY aes = {};
+	if(0 != (encrypt ?
+		AES_set_encrypt_key(pcuchar(key.data()), key.length() * 8, &aes) :
+		AES_set_decrypt_key(pcuchar(key.data()), key.length() * 8, &aes)))
+		return result;
+	result.resize(data.size() + 8);
+	int size = encrypt ?
+		AES_wrap_key(&aes, nullptr, puchar(result.data()), pcuchar(data.data()), uint(data.size())) :
+		AES_unwrap_key(&aes, nullptr, puchar(result.data()), pcuchar(data.data()), uint(data.size()));
+	if(size > 0)
+		result.resize(size);
+	else
+		result.clear();
 	return result;
 }
 
@@ -277,41 +1301,89 @@ QByteArray CryptoDoc::Private::fromBase64(const QStringView &data)
 QByteArray CryptoDoc::Private::fromBase64(const QStringRef &data)
 #endif
 {
-	unsigned int buf = 0;
-	int nbits = 0;
 	QByteArray result((data.size() * 3) / 4, Qt::Uninitialized);
+	const ushort *in = reinterpret_cast<const ushort*>(data.constData());
+	const char *end = Base64Decoder().decode(in, in + data.size(), result.data());
+	result.truncate(int(end - result.constData()));
+	return result;
+}
 
-	int offset = 0;
-	for(const QChar &i: data)
-	{
-		int ch = i.toLatin1();
-		int d;
-
-		if (ch >= 'A' && ch <= 'Z')
-			d = ch - 'A';
-		else if (ch >= 'a' && ch <= 'z')
-			d = ch - 'a' + 26;
-		else if (ch >= '0' && ch <= '9')
-			d = ch - '0' + 52;
-		else if (ch == '+')
-			d = 62;
-		else if (ch == '/')
-			d = 63;
-		else
-			continue;
-
-		buf = (buf << 6) | uint(d);
-		nbits += 6;
-		if(nbits >= 8)
+bool CryptoDoc::Private::decrypt(QIODevice *in, qint64 size, QIODevice *out)
+{
+	const EVP_CIPHER *cipher = ENC_MTH.value(method);
+	if(!cipher)
+		return false;
+	if(binary)
+	{
+		if(EVP_CIPHER_mode(cipher) != EVP_CIPH_GCM_MODE)
+			return false;
+		ChunkDevice dec(cipher, key, chunkNonce, headerDigest, false, out);
+		QByteArray buf(int(BLOCK_SIZE), Qt::Uninitialized);
+		while(size > 0)
 		{
-			nbits -= 8;
-			result[offset++] = char(buf >> nbits);
-			buf &= (1 << nbits) - 1;
+			qint64 read = in->read(buf.data(), qMin<qint64>(size, buf.size()));
+			if(read <= 0 || !step(read) || dec.write(buf.constData(), read) != read)
+				return false;
+			size -= read;
 		}
+		return dec.finalize();
 	}
 
-	result.truncate(offset);
-	return result;
+	CipherDevice dec(cipher, key, false, method == AES128CBC_MTH, out);
+	Base64Decoder base64;
+	QByteArray buf(int(BLOCK_SIZE), Qt::Uninitialized), decoded(int(BLOCK_SIZE), Qt::Uninitialized);
+	while(size > 0)
+	{
+		qint64 read = in->read(buf.data(), qMin<qint64>(size, buf.size()));
+		if(read <= 0)
+			return false;
+		size -= read;
+		if(!step(read))
+			return false;
+		const char *end = base64.decode(buf.constData(), buf.constData() + read, decoded.data());
+		qint64 decodedSize = end - decoded.constData();
+		if(dec.write(decoded.constData(), decodedSize) != decodedSize)
+			return false;
+	}
+	return dec.finalize();
+}
+
+bool CryptoDoc::Private::step(qint64 bytes)
+{
+	if(cancelled)
+		return false;
+	progressDone += bytes;
+	int percent = progressTotal > 0 ? int(progressDone * 100 / progressTotal) : 0;
+	if(percent != progressPercent)
+	{
+		progressPercent = percent;
+		emit progress(progressDone, progressTotal);
+	}
+	return true;
+}
+
+bool CryptoDoc::Private::unwrapKey(const CKey &k)
+{
+	bool isECDH = k.info()->algorithm == QSsl::Ec;
+	QByteArray decryptedKey;
+	if(qApp->signer()->decrypt(isECDH ? k.publicKey : k.cipher, decryptedKey,
+			k.concatDigest, int(KWAES_SIZE[k.method]), k.AlgorithmID, k.PartyUInfo, k.PartyVInfo) != QSigner::DecryptOK)
+		return false;
+	if(isECDH)
+	{
+#ifndef NDEBUG
+		qDebug() << "DEC Ss" << k.publicKey.toHex();
+		qDebug() << "DEC ConcatKDF" << decryptedKey.toHex();
+#endif
+		key = AES_wrap(decryptedKey, k.cipher, false);
+		opensslError(key.isEmpty());
+	}
+	else // RSA decrypts directly transport key
+		key = decryptedKey;
+#ifndef NDEBUG
+	qDebug() << "DEC transport" << key.toHex();
+#endif
+	return true;
 }
 
 bool CryptoDoc::Private::isEncryptedWarning()
@@ -336,119 +1408,216 @@ bool CryptoDoc::Private::opensslError(bool err)
 
 void CryptoDoc::Private::run()
 {
+	lastError.clear();
+	if(!newKeys.isEmpty())
+	{
+		qCDebug(CRYPTO) << "Change recipients" << fileName;
+		QSaveFile cdoc(fileName);
+		if((!cdoc.open(QFile::WriteOnly) || !rekey(&cdoc, newKeys) || !cdoc.commit()) && !cancelled)
+			lastError = CryptoDoc::tr("Failed to change recipients");
+		return;
+	}
 	if( !encrypted )
 	{
 		qCDebug(CRYPTO) << "Encrypt" << fileName;
-		QBuffer data;
-		data.open(QBuffer::WriteOnly);
-
+		// Directories are packed file by file into the DDoc stream, model keeps them as single entries
+		const QList<File> entries = dataFiles();
+		if(entries.isEmpty())
+		{
+			lastError = CryptoDoc::tr("Cannot add empty file to the container.");
+			return;
+		}
 		QString mime, name;
-		if(files.size() > 1 || QSettings().value(QStringLiteral("cdocwithddoc"), false).toBool())
+		bool isDDoc = entries.size() > 1 || entries[0].name.contains('/') || options.legacy;
+		if(isDDoc)
 		{
 			qCDebug(CRYPTO) << "Creating DDoc container";
-			writeDDoc(&data);
 			mime = MIME_DDOC;
 			name = QFileInfo(fileName).completeBaseName() + ".ddoc";
 		}
 		else
 		{
 			qCDebug(CRYPTO) << "Adding raw file";
-			data.write(files[0].data);
-			mime = files[0].mime;
-			name = files[0].name;
+			mime = entries[0].mime;
+			name = entries[0].name;
 		}
 // TODO? new check box "I would like to encrypt for recipients who are using an older DigiDoc3 Crypto\nsoftware (version 3.8 and earlier)." 
 // to SettingsDialog (like in qdigidoc3).
-		if(QSettings().value(QStringLiteral("cdocwithddoc"), false).toBool())
+		if(options.legacy)
 			method = AES128CBC_MTH;
 		else
 			method = AES256GCM_MTH;
+		// CDOC 1.0 uses AES-CBC with ANSIX923 padding
+		QString version = method == AES128CBC_MTH ? QStringLiteral("1.0") : QStringLiteral("1.1");
 
-		QString version = QStringLiteral("1.1");
-		if(method == AES128CBC_MTH) // add ANSIX923 padding
+		const EVP_CIPHER *cipher = ENC_MTH[method];
+#ifdef WIN32
+		RAND_poll();
+#else
+		RAND_load_file("/dev/urandom", 1024);
+#endif
+		key.resize(EVP_CIPHER_key_length(cipher));
+		for(const File &f: entries)
+			progressTotal += f.fileSize();
+		// Binary format is opt-in, other clients do not support it
+		const bool isBinary = method != AES128CBC_MTH && options.binary;
+		QMultiHash<QString,QString> props = encryptionProperties(name, version, entries);
+		// Compression is opt-in and skipped for data which looks already compressed
+		const bool isZlib = options.compress && isCompressible(entries);
+		if(isZlib)
 		{
-			version = QStringLiteral("1.0");
-			QByteArray ansix923(16 - (data.size() % 16), 0);
-			qCDebug(CRYPTO) << "Adding ANSIX923 padding size" << ansix923.size();
-			ansix923[ansix923.size() - 1] = char(ansix923.size());
-			data.write(ansix923);
-			data.close();
+			qCDebug(CRYPTO) << "Compressing content";
+			props.insert(QStringLiteral("OriginalMimeType"), mime);
+			props.insert(QStringLiteral("OriginalSize"), QString::number(isDDoc ? ddocSize(entries) : entries[0].fileSize()));
+			mime = MIME_ZLIB;
 		}
-
-		QByteArray result = crypto(ENC_MTH[method], data.data(), true);
+		auto content = [&](QIODevice *out) {
+			if(isDDoc)
+				return writeDDoc(out, entries);
+			ProgressDevice progress(out, [this](qint64 size) { return step(size); });
+			return entries[0].write(&progress);
+		};
+		auto data = [&](QIODevice *enc) {
+			if(!isZlib)
+				return content(enc);
+			DeflateDevice zlib(enc);
+			return content(&zlib) && zlib.finalize();
+		};
 		QFile cdoc(fileName);
-		cdoc.open(QFile::WriteOnly);
-		writeCDoc(&cdoc, key, result, name, version, mime);
+		bool result = !opensslError(RAND_bytes(puchar(key.data()), key.size()) <= 0) &&
+			cdoc.open(QFile::WriteOnly) &&
+			(isBinary ? writeBinary(&cdoc, key, data, props, mime) :
+			writeCDoc(&cdoc, key, [&](QXmlStreamWriter &w) {
+				Base64Writer base64(w);
+				CipherDevice enc(cipher, key, true, method == AES128CBC_MTH, &base64);
+				return data(&enc) && enc.finalize() && base64.finalize();
+			}, props, mime));
 		cdoc.close();
+		if(!result)
+		{
+			cdoc.remove();
+			if(!cancelled)
+				lastError = CryptoDoc::tr("Failed to encrypt document");
+			return;
+		}
 
-		delete ddoc;
-		ddoc = nullptr;
+		ddoc.clear();
 	}
 	else
 	{
 		qCDebug(CRYPTO) << "Decrypt" << fileName;
 		QFile cdoc(fileName);
-		cdoc.open(QFile::ReadOnly);
-		QByteArray result = readCDoc(&cdoc, true);
-		cdoc.close();
-		result = crypto(ENC_MTH[method], result, false);
-
-		// remove ANSIX923 padding
-		if(result.size() > 0 && method == AES128CBC_MTH)
+		if(!cdoc.open(QFile::ReadOnly) || (cipherPos < 0 && cipherText.isEmpty()))
 		{
-			QByteArray ansix923(result[result.size()-1], 0);
-			ansix923[ansix923.size()-1] = char(ansix923.size());
-			if(result.right(ansix923.size()) == ansix923)
-			{
-				qCDebug(CRYPTO) << "Removing ANSIX923 padding size:" << ansix923.size();
-				result.resize(result.size() - ansix923.size());
-			}
+			lastError = CryptoDoc::tr("Error parsing document");
+			return;
+		}
+		QBuffer text(&cipherText);
+		QIODevice *in = &cdoc;
+		qint64 inSize = cipherSize;
+		if(cipherPos < 0)
+		{
+			text.open(QBuffer::ReadOnly);
+			in = &text;
+			inSize = text.size();
+		}
+		else
+			cdoc.seek(cipherPos);
+		progressTotal = inSize;
+
+		const QString contentMime = mime == MIME_ZLIB ? properties[QStringLiteral("OriginalMimeType")] : mime;
+		const bool isDDoc = contentMime == MIME_DDOC || contentMime == MIME_DDOC_OLD;
+		// Small raw file is kept in memory, larger one is stored to temporary file readable only
+		// by the owner, so plaintext is not left on disk for payloads which fit into memory.
+		// DDoc is stored to temporary file and parsed while decrypting, its files refer to the stored DDoc.
+		qint64 plainSize = -1;
+		if(mime != MIME_ZLIB)
+			plainSize = binary ? inSize : inSize / 4 * 3;
+		else
+		{
+			bool converted = false;
+			qint64 originalSize = properties.value(QStringLiteral("OriginalSize")).toLongLong(&converted);
+			if(converted && originalSize >= 0)
+				plainSize = originalSize;
+		}
+		const bool inMemory = !isDDoc && plainSize >= 0 && plainSize <= MEMORY_LIMIT;
+		QByteArray plain;
+		QBuffer buffer(&plain);
+		QTemporaryFile tmp(QDir::tempPath() + "/XXXXXX");
+		QIODevice *out = &tmp;
+		if(inMemory)
+		{
+			buffer.open(QBuffer::WriteOnly);
+			out = &buffer;
+		}
+		else if(!tmp.open() || !tmp.setPermissions(QFile::ReadOwner|QFile::WriteOwner))
+		{
+			lastError = CryptoDoc::tr("Failed to create temporary files<br />%1").arg(tmp.errorString());
+			return;
+		}
+		DDocReader ddocReader(&tmp);
+		if(isDDoc)
+		{
+			qCDebug(CRYPTO) << "Parsing DDOC container";
+			out = &ddocReader;
 		}
 
+		bool result = false;
 		if(mime == MIME_ZLIB)
 		{
-			// Add size header for qUncompress compatibilty
-			unsigned int origsize = std::max<unsigned>(properties[QStringLiteral("OriginalSize")].toUInt(), 1);
-			qCDebug(CRYPTO) << "Decompressing zlib content size" << origsize;
-			QByteArray size(4, 0);
-			size[0] = char((origsize & 0xff000000) >> 24);
-			size[1] = char((origsize & 0x00ff0000) >> 16);
-			size[2] = char((origsize & 0x0000ff00) >> 8);
-			size[3] = char((origsize & 0x000000ff));
-			result = qUncompress(size + result);
-			mime = properties[QStringLiteral("OriginalMimeType")];
+			qCDebug(CRYPTO) << "Decompressing zlib content";
+			// Crafted payload could otherwise fill the disk with inflated data
+			qint64 limit = inSize * MAX_INFLATE_RATIO;
+			if(plainSize >= 0)
+				limit = qMin(limit, plainSize);
+			InflateDevice zlib(out, limit);
+			result = decrypt(in, inSize, &zlib) && zlib.finalize();
 		}
+		else
+			result = decrypt(in, inSize, out);
+		if(!result || (!inMemory && !tmp.flush()))
+		{
+			if(!cancelled)
+				lastError = CryptoDoc::tr("Failed to decrypt document");
+			return;
+		}
+		mime = contentMime;
 
-		if(mime == MIME_DDOC || mime == MIME_DDOC_OLD)
+		if(isDDoc)
 		{
 			qCDebug(CRYPTO) << "Contains DDoc content" << mime;
-			ddoc = new QTemporaryFile(QDir::tempPath() + "/XXXXXX");
-			if( !ddoc->open() )
-			{
-				lastError = CryptoDoc::tr("Failed to create temporary files<br />%1").arg( ddoc->errorString() );
-				return;
-			}
-			ddoc->write(result);
-			ddoc->flush();
-			ddoc->reset();
-			readDDoc(ddoc);
+			ddocReader.finalize(this);
+			tmp.setAutoRemove(false);
+			tempFiles << tmp.fileName();
+			ddoc = tmp.fileName();
 		}
 		else
 		{
 			qCDebug(CRYPTO) << "Contains raw file" << mime;
-			if(!files.isEmpty())
-				files[0].data = result;
-			else if(properties.contains(QStringLiteral("Filename")))
+			if(files.isEmpty() && properties.contains(QStringLiteral("Filename")))
 			{
 				File f;
 				f.name = properties[QStringLiteral("Filename")];
 				f.mime = mime;
-				f.size = FileDialog::fileSize(quint64(result.size()));
-				f.data = result;
 				files << f;
 			}
-			else
+			if(files.isEmpty())
+			{
 				lastError = CryptoDoc::tr("Error parsing document");
+				return;
+			}
+			if(inMemory)
+			{
+				files[0].data = plain;
+				files[0].size = FileDialog::fileSize(quint64(plain.size()));
+			}
+			else
+			{
+				tmp.setAutoRemove(false);
+				tempFiles << tmp.fileName();
+				files[0].path = tmp.fileName();
+				files[0].size = FileDialog::fileSize(quint64(tmp.size()));
+			}
 		}
 	}
 	encrypted = !encrypted;
@@ -459,19 +1628,49 @@ void CryptoDoc::Private::setLastError( const QString &err )
 	qApp->showWarning(err);
 }
 
-QByteArray CryptoDoc::Private::readCDoc(QIODevice *cdoc, bool data)
+bool CryptoDoc::Private::readBinary(QIODevice *cdoc)
 {
-	qCDebug(CRYPTO) << "Parsing CDOC file, reading data only" << data;
-	QXmlStreamReader xml(cdoc);
+	qCDebug(CRYPTO) << "Parsing binary CDOC file";
+	if(cdoc->read(BINARY_MAGIC.size()) != BINARY_MAGIC)
+		return false;
+	QByteArray size = cdoc->read(4);
+	if(size.size() != 4)
+		return false;
+	quint32 headerSize = qFromBigEndian<quint32>(size.constData());
+	if(headerSize > quint32(cdoc->size() - cdoc->pos()))
+		return false;
+	QByteArray header = cdoc->read(headerSize);
+	chunkNonce = cdoc->read(ChunkDevice::NONCE_SIZE);
+	if(header.size() != int(headerSize) || chunkNonce.size() != ChunkDevice::NONCE_SIZE)
+		return false;
+	QBuffer buffer(&header);
+	if(!buffer.open(QBuffer::ReadOnly) || !readCDoc(&buffer))
+		return false;
+	binary = true;
+	headerDigest = QCryptographicHash::hash(header, QCryptographicHash::Sha256);
+	cipherText.clear();
+	cipherPos = cdoc->pos();
+	cipherSize = cdoc->size() - cipherPos;
+	return true;
+}
 
-	if(!data)
-	{
-		files.clear();
-		keys.clear();
-		properties.clear();
-		method.clear();
-		mime.clear();
-	}
+bool CryptoDoc::Private::readCDoc(QIODevice *cdoc, bool headerOnly)
+{
+	qCDebug(CRYPTO) << "Parsing CDOC file";
+	// EncryptedData/CipherData/CipherValue
+	PayloadFilter filter(cdoc, QByteArrayLiteral("CipherValue>"), 3, headerOnly);
+	QXmlStreamReader xml(&filter);
+
+	files.clear();
+	keys.clear();
+	keyIndex.clear();
+	properties.clear();
+	origFiles.clear();
+	method.clear();
+	mime.clear();
+	cipherText.clear();
+	cipherPos = -1;
+	cipherSize = 0;
 	while( !xml.atEnd() )
 	{
 		switch(xml.readNext())
@@ -479,25 +1678,11 @@ QByteArray CryptoDoc::Private::readCDoc(QIODevice *cdoc, bool data)
 		case QXmlStreamReader::StartElement: break;
 		case QXmlStreamReader::DTD:
 			qCWarning(CRYPTO) << "XML DTD Declarations are not supported";
-			return {};
-		case QXmlStreamReader::EntityReference:
-			qCWarning(CRYPTO) << "XML ENTITY References are not supported";
-			return {};
-		default: continue;
-		}
-
-		if(data)
-		{
-			// EncryptedData/KeyInfo
-			if(xml.name() == QStringLiteral("KeyInfo"))
-				xml.skipCurrentElement();
-			// EncryptedData/CipherData/CipherValue
-			else if(xml.name() == QStringLiteral("CipherValue"))
-			{
-				xml.readNext();
-				return fromBase64(xml.text());
-			}
-			continue;
+			return false;
+		case QXmlStreamReader::EntityReference:
+			qCWarning(CRYPTO) << "XML ENTITY References are not supported";
+			return false;
+		default: continue;
 		}
 
 		// EncryptedData
@@ -512,7 +1697,8 @@ QByteArray CryptoDoc::Private::readCDoc(QIODevice *cdoc, bool data)
 					continue;
 				if(attr.value() == QStringLiteral("orig_file"))
 				{
-					QStringList fileparts = xml.readElementText().split('|');
+					origFiles << xml.readElementText();
+					QStringList fileparts = origFiles.last().split('|');
 					File file;
 					file.name = fileparts.value(0);
 					file.size = size(fileparts.value(1));
@@ -524,6 +1710,18 @@ QByteArray CryptoDoc::Private::readCDoc(QIODevice *cdoc, bool data)
 					properties[attr.value().toString()] = xml.readElementText();
 			}
 		}
+		// EncryptedData/CipherData/CipherValue, large payload is left out by the filter
+		else if(xml.name() == QStringLiteral("CipherValue"))
+		{
+			xml.readNext();
+			if(const PayloadFilter::Run *run = filter.skippedRun(xml.text().toString()))
+			{
+				cipherPos = run->pos;
+				cipherSize = run->size;
+			}
+			else
+				cipherText = xml.text().toLatin1();
+		}
 		// EncryptedData/EncryptionMethod
 		else if(xml.name() == QStringLiteral("EncryptionMethod"))
 			method = xml.attributes().value(QStringLiteral("Algorithm")).toString();
@@ -531,6 +1729,7 @@ QByteArray CryptoDoc::Private::readCDoc(QIODevice *cdoc, bool data)
 		else if(xml.name() == QStringLiteral("EncryptedKey"))
 		{
 			CKey key;
+			QByteArray der;
 			key.id = xml.attributes().value(QStringLiteral("Id")).toString();
 			key.recipient = xml.attributes().value(QStringLiteral("Recipient")).toString();
 			while(!xml.atEnd())
@@ -575,7 +1774,8 @@ QByteArray CryptoDoc::Private::readCDoc(QIODevice *cdoc, bool data)
 				else if(xml.name() == QStringLiteral("X509Certificate"))
 				{
 					xml.readNext();
-					key.cert = QSslCertificate( fromBase64( xml.text() ), QSsl::Der );
+					der = fromBase64(xml.text());
+					key.setDer(der);
 				}
 				// EncryptedData/KeyInfo/EncryptedKey/KeyInfo/CipherData/CipherValue
 				else if(xml.name() == QStringLiteral("CipherValue"))
@@ -584,29 +1784,207 @@ QByteArray CryptoDoc::Private::readCDoc(QIODevice *cdoc, bool data)
 					key.cipher = fromBase64(xml.text());
 				}
 			}
+			if(!der.isEmpty())
+				indexKey(der, keys.size());
 			keys << key;
 		}
 	}
-	return {};
+	return !xml.hasError();
+}
+
+bool CryptoDoc::Private::rekey(QIODevice *cdoc, const QList<CKey> &newKeys)
+{
+	qCDebug(CRYPTO) << "Rekey" << fileName << "for" << newKeys.size() << "recipients";
+	QFile in(fileName);
+	if(!in.open(QFile::ReadOnly) || (cipherPos < 0 && cipherText.isEmpty()))
+		return false;
+	QMultiHash<QString,QString> props;
+	for(QHash<QString,QString>::const_iterator i = properties.cbegin(); i != properties.cend(); ++i)
+		props.insert(i.key(), i.value());
+	props.replace(QStringLiteral("LibraryVersion"), QCoreApplication::applicationName() + "|" + QCoreApplication::applicationVersion());
+	// QMultiHash returns values of the same key starting from the last inserted, like in encryptionProperties
+	for(auto i = origFiles.crbegin(); i != origFiles.crend(); ++i)
+		props.insert(QStringLiteral("orig_file"), *i);
+
+	// Check on a header without keys and payload that properties are written back in the same order
+	Private check;
+	check.method = method;
+	QByteArray header;
+	QBuffer buffer(&header);
+	if(!buffer.open(QBuffer::WriteOnly) ||
+		!check.writeCDoc(&buffer, {}, [](QXmlStreamWriter & /*w*/) { return true; }, props, mime))
+		return false;
+	buffer.close();
+	if(!buffer.open(QBuffer::ReadOnly) || !check.readCDoc(&buffer, true) || check.origFiles != origFiles)
+	{
+		qCWarning(CRYPTO) << "Document properties do not match after writing";
+		return false;
+	}
+
+	reset();
+	progressTotal = cipherSize;
+	const QList<CKey> oldKeys = keys;
+	keys = newKeys;
+	bool result = false;
+	if(binary)
+	{
+		// Chunk tags are bound to the header digest, chunks are re-sealed with the same transport key
+		result = in.seek(cipherPos) && writeBinary(cdoc, key, [&](QIODevice *enc) {
+			return decrypt(&in, cipherSize, enc);
+		}, props, mime);
+	}
+	else
+	{
+		result = writeCDoc(cdoc, key, [&](QXmlStreamWriter &w) {
+			if(cipherPos < 0)
+			{
+				w.writeCharacters(QString::fromLatin1(cipherText));
+				return !w.hasError();
+			}
+			// Payload of the old document is decoded and encoded again through the writer,
+			// ciphertext is not changed
+			if(!in.seek(cipherPos))
+				return false;
+			Base64Writer base64(w);
+			Base64Decoder decoder;
+			QByteArray buf(int(BLOCK_SIZE), Qt::Uninitialized), decoded(int(BLOCK_SIZE), Qt::Uninitialized);
+			for(qint64 size = cipherSize; size > 0;)
+			{
+				qint64 read = in.read(buf.data(), qMin<qint64>(size, buf.size()));
+				if(read <= 0 || !step(read))
+					return false;
+				size -= read;
+				qint64 decodedSize = decoder.decode(buf.constData(), buf.constData() + read, decoded.data()) - decoded.constData();
+				if(base64.write(decoded.constData(), decodedSize) != decodedSize)
+					return false;
+			}
+			return base64.finalize();
+		}, props, mime);
+	}
+	keys = oldKeys;
+	return result;
 }
 
-void CryptoDoc::Private::writeCDoc(QIODevice *cdoc, const QByteArray &transportKey,
-	const QByteArray &encryptedData, const QString &file, const QString &ver, const QString &mime)
+bool CryptoDoc::Private::wrapKey(const CKey &k, const QByteArray &transportKey, const QByteArray &docFormat, WrappedKey &wrapped)
 {
+	const std::shared_ptr<const CKey::Info> info = k.info();
+	EVP_PKEY *peerPKey = info->key.get();
+	wrapped.cert = k.der();
+	if(opensslError(!peerPKey))
+		return false;
+	if(info->algorithm == QSsl::Rsa)
+	{
+		wrapped.method = RSA_MTH;
+		auto ctx = SCOPE(EVP_PKEY_CTX, EVP_PKEY_CTX_new(peerPKey, nullptr));
+		size_t size = 0;
+		if(opensslError(!ctx) ||
+			opensslError(EVP_PKEY_encrypt_init(ctx.get()) <= 0) ||
+			opensslError(EVP_PKEY_CTX_set_rsa_padding(ctx.get(), RSA_PKCS1_PADDING) <= 0) ||
+			opensslError(EVP_PKEY_encrypt(ctx.get(), nullptr, &size,
+				pcuchar(transportKey.constData()), size_t(transportKey.size())) <= 0))
+			return false;
+		wrapped.cipher.resize(int(size));
+		if(opensslError(EVP_PKEY_encrypt(ctx.get(), puchar(wrapped.cipher.data()), &size,
+				pcuchar(transportKey.constData()), size_t(transportKey.size())) <= 0))
+			return false;
+		wrapped.cipher.resize(int(size));
+		return true;
+	}
+
+	auto priv = SCOPE(EC_KEY, EC_KEY_new_by_curve_name(info->curve));
+	auto pkey = SCOPE(EVP_PKEY, EVP_PKEY_new());
+	if (opensslError(EC_KEY_generate_key(priv.get()) <= 0) ||
+		opensslError(EVP_PKEY_set1_EC_KEY(pkey.get(), priv.get()) <= 0))
+		return false;
+	auto ctx = SCOPE(EVP_PKEY_CTX, EVP_PKEY_CTX_new(pkey.get(), nullptr));
+	size_t sharedSecretLen = 0;
+	if (opensslError(!ctx) ||
+		opensslError(EVP_PKEY_derive_init(ctx.get()) <= 0) ||
+		opensslError(EVP_PKEY_derive_set_peer(ctx.get(), peerPKey) <= 0) ||
+		opensslError(EVP_PKEY_derive(ctx.get(), nullptr, &sharedSecretLen) <= 0))
+		return false;
+	QByteArray sharedSecret(int(sharedSecretLen), 0);
+	if(opensslError(EVP_PKEY_derive(ctx.get(), puchar(sharedSecret.data()), &sharedSecretLen) <= 0))
+		return false;
+
+	wrapped.oid.resize(50);
+	wrapped.oid.resize(OBJ_obj2txt(wrapped.oid.data(), wrapped.oid.size(), OBJ_nid2obj(EC_GROUP_get_curve_name(EC_KEY_get0_group(priv.get()))), 1));
+	wrapped.SsDer = QByteArray(i2d_PublicKey(pkey.get(), nullptr), 0);
+	puchar p = puchar(wrapped.SsDer.data());
+	i2d_PublicKey(pkey.get(), &p);
+
+	wrapped.method = KWAES256_MTH;
+	switch((wrapped.SsDer.size() - 1) / 2) {
+	case 32: wrapped.concatDigest = SHA256_MTH; break;
+	case 48: wrapped.concatDigest = SHA384_MTH; break;
+	default: wrapped.concatDigest = SHA512_MTH; break;
+	}
+	QByteArray encryptionKey = CryptoDoc::concatKDF(wrapped.concatDigest, KWAES_SIZE[wrapped.method],
+		sharedSecret, docFormat + wrapped.SsDer + wrapped.cert);
 #ifndef NDEBUG
-	qDebug() << "ENC Transport Key" << transportKey.toHex();
+	qDebug() << "ENC Ss" << wrapped.SsDer.toHex();
+	qDebug() << "ENC Ksr" << sharedSecret.toHex();
+	qDebug() << "ENC ConcatKDF" << encryptionKey.toHex();
 #endif
 
-	qCDebug(CRYPTO) << "Writing CDOC file ver" << ver << "mime" << mime;
+	wrapped.cipher = AES_wrap(encryptionKey, transportKey, true);
+	return !opensslError(wrapped.cipher.isEmpty());
+}
+
+bool CryptoDoc::Private::writeBinary(QIODevice *cdoc, const QByteArray &transportKey, const std::function<bool(QIODevice*)> &data,
+	const QMultiHash<QString,QString> &props, const QString &mime)
+{
+	qCDebug(CRYPTO) << "Writing binary CDOC file";
+	// Header is a CDOC document without payload
+	QByteArray header;
+	QBuffer buffer(&header);
+	if(!buffer.open(QBuffer::WriteOnly) ||
+		!writeCDoc(&buffer, transportKey, [](QXmlStreamWriter & /*w*/) { return true; }, props, mime))
+		return false;
+	buffer.close();
+
+	QByteArray nonce(ChunkDevice::NONCE_SIZE, 0), size(4, 0);
+	qToBigEndian<quint32>(quint32(header.size()), size.data());
+	if(opensslError(RAND_bytes(puchar(nonce.data()), nonce.size()) <= 0) ||
+		cdoc->write(BINARY_MAGIC + size + header + nonce) != BINARY_MAGIC.size() + size.size() + header.size() + nonce.size())
+		return false;
+	ChunkDevice enc(ENC_MTH[method], transportKey, nonce, QCryptographicHash::hash(header, QCryptographicHash::Sha256), true, cdoc);
+	return data(&enc) && enc.finalize();
+}
+
+QMultiHash<QString,QString> CryptoDoc::Private::encryptionProperties(const QString &file, const QString &ver, const QList<File> &entries)
+{
 	QMultiHash<QString,QString> props;
 	props.insert(QStringLiteral("DocumentFormat"), "ENCDOC-XML|" + ver);
-	props.insert(QStringLiteral("LibraryVersion"), qApp->applicationName() + "|" + qApp->applicationVersion());
+	props.insert(QStringLiteral("LibraryVersion"), QCoreApplication::applicationName() + "|" + QCoreApplication::applicationVersion());
 	props.insert(QStringLiteral("Filename"), file);
-	QList<File> reverse = files;
+	QList<File> reverse = entries;
 	std::reverse(reverse.begin(), reverse.end());
 	for(const File &f: qAsConst(reverse))
-		props.insert(QStringLiteral("orig_file"), QStringLiteral("%1|%2|%3|%4").arg(f.name).arg(f.data.size()).arg(f.mime).arg(f.id));
+		props.insert(QStringLiteral("orig_file"), QStringLiteral("%1|%2|%3|%4").arg(f.name).arg(f.fileSize()).arg(f.mime).arg(f.id));
+	return props;
+}
+
+bool CryptoDoc::Private::writeCDoc(QIODevice *cdoc, const QByteArray &transportKey,
+	const std::function<bool(QXmlStreamWriter&)> &cipherValue, const QMultiHash<QString,QString> &props, const QString &mime)
+{
+#ifndef NDEBUG
+	qDebug() << "ENC Transport Key" << transportKey.toHex();
+#endif
+
+	qCDebug(CRYPTO) << "Writing CDOC file" << props.value(QStringLiteral("DocumentFormat")) << "mime" << mime;
+	// Recipient keys are wrapped in parallel, results are kept in recipient order
+	const QByteArray docFormat = props.value(QStringLiteral("DocumentFormat")).toUtf8();
+	std::vector<WrappedKey> wrappedKeys(size_t(keys.size()));
+	std::atomic<bool> wrapFailed{false};
+	parallelFor(keys.size(), [&](int i) {
+		if(!wrapFailed && !wrapKey(keys.at(i), transportKey, docFormat, wrappedKeys[size_t(i)]))
+			wrapFailed = true;
+	});
+	if(wrapFailed)
+		return false;
 
+	bool result = false;
 	QXmlStreamWriter w(cdoc);
 	w.setAutoFormatting(true);
 	w.writeStartDocument();
@@ -617,114 +1995,64 @@ void CryptoDoc::Private::writeCDoc(QIODevice *cdoc, const QByteArray &transportK
 		writeElement(w, DENC, QStringLiteral("EncryptionMethod"), {{"Algorithm", method}});
 		w.writeNamespace(DS, QStringLiteral("ds"));
 		writeElement(w, DS, QStringLiteral("KeyInfo"), [&]{
-		for(const CKey &k: qAsConst(keys))
+		for(int i = 0; i < keys.size(); ++i)
 		{
+			const CKey &k = keys.at(i);
+			const WrappedKey &wrapped = wrappedKeys[size_t(i)];
 			writeElement(w, DENC, QStringLiteral("EncryptedKey"), [&]{
 				if(!k.id.isEmpty())
 					w.writeAttribute(QStringLiteral("Id"), k.id);
 				if(!k.recipient.isEmpty())
 					w.writeAttribute(QStringLiteral("Recipient"), k.recipient);
-				QByteArray cipher;
-				if (k.cert.publicKey().algorithm() == QSsl::Rsa)
+				writeElement(w, DENC, QStringLiteral("EncryptionMethod"), {{"Algorithm", wrapped.method}});
+				if(wrapped.method == RSA_MTH)
 				{
-					RSA *rsa = static_cast<RSA*>(k.cert.publicKey().handle());
-					cipher.resize(RSA_size(rsa));
-					if(opensslError(RSA_public_encrypt(transportKey.size(), pcuchar(transportKey.constData()),
-						puchar(cipher.data()), rsa, RSA_PKCS1_PADDING) <= 0))
-						return;
-					writeElement(w, DENC, QStringLiteral("EncryptionMethod"), {{"Algorithm", RSA_MTH}});
 					writeElement(w, DS, QStringLiteral("KeyInfo"), [&]{
 						if(!k.name.isEmpty())
 							w.writeTextElement(DS, QStringLiteral("KeyName"), k.name);
 						writeElement(w, DS, QStringLiteral("X509Data"), [&]{
-							writeBase64Element(w, DS, QStringLiteral("X509Certificate"), k.cert.toDer());
+							writeBase64Element(w, DS, QStringLiteral("X509Certificate"), wrapped.cert);
 						});
 					});
 				}
 				else
 				{
-					QByteArray derCert = k.cert.toDer();
-					pcuchar pp = pcuchar(derCert.data());
-					auto peerCert = SCOPE(X509, d2i_X509(nullptr, &pp, derCert.size()));
-					EVP_PKEY *peerPKey = X509_get0_pubkey(peerCert.get());
-					const EC_KEY *peerECKey = EVP_PKEY_get0_EC_KEY(peerPKey);
-					int curve = EC_GROUP_get_curve_name(EC_KEY_get0_group(peerECKey));
-					auto priv = SCOPE(EC_KEY, EC_KEY_new_by_curve_name(curve));
-					auto pkey = SCOPE(EVP_PKEY, EVP_PKEY_new());
-					if (opensslError(EC_KEY_generate_key(priv.get()) <= 0) ||
-						opensslError(EVP_PKEY_set1_EC_KEY(pkey.get(), priv.get()) <= 0))
-						return;
-					auto ctx = SCOPE(EVP_PKEY_CTX, EVP_PKEY_CTX_new(pkey.get(), nullptr));
-					size_t sharedSecretLen = 0;
-					if (opensslError(!ctx) ||
-						opensslError(EVP_PKEY_derive_init(ctx.get()) <= 0) ||
-						opensslError(EVP_PKEY_derive_set_peer(ctx.get(), peerPKey) <= 0) ||
-						opensslError(EVP_PKEY_derive(ctx.get(), nullptr, &sharedSecretLen) <= 0))
-						return;
-					QByteArray sharedSecret(int(sharedSecretLen), 0);
-					if(opensslError(EVP_PKEY_derive(ctx.get(), puchar(sharedSecret.data()), &sharedSecretLen) <= 0))
-						return;
-
-					QByteArray oid(50, 0);
-					oid.resize(OBJ_obj2txt(oid.data(), oid.size(), OBJ_nid2obj(EC_GROUP_get_curve_name(EC_KEY_get0_group(priv.get()))), 1));
-					QByteArray SsDer(i2d_PublicKey(pkey.get(), nullptr), 0);
-					puchar p = puchar(SsDer.data());
-					i2d_PublicKey(pkey.get(), &p);
-
-					const QString encryptionMethod = KWAES256_MTH;
-					QString concatDigest = SHA384_MTH;
-					switch((SsDer.size() - 1) / 2) {
-					case 32: concatDigest = SHA256_MTH; break;
-					case 48: concatDigest = SHA384_MTH; break;
-					default: concatDigest = SHA512_MTH; break;
-					}
-					QByteArray encryptionKey = CryptoDoc::concatKDF(concatDigest, KWAES_SIZE[encryptionMethod],
-						sharedSecret, props.value(QStringLiteral("DocumentFormat")).toUtf8() + SsDer + k.cert.toDer());
-#ifndef NDEBUG
-					qDebug() << "ENC Ss" << SsDer.toHex();
-					qDebug() << "ENC Ksr" << sharedSecret.toHex();
-					qDebug() << "ENC ConcatKDF" << encryptionKey.toHex();
-#endif
-
-					cipher = AES_wrap(encryptionKey, transportKey, true);
-					if(opensslError(cipher.isEmpty()))
-						return;
-
-					writeElement(w, DENC, QStringLiteral("EncryptionMethod"), {{"Algorithm", encryptionMethod}});
 					writeElement(w, DS, QStringLiteral("KeyInfo"), [&]{
 						writeElement(w, DENC, QStringLiteral("AgreementMethod"), {{"Algorithm", AGREEMENT_MTH}}, [&]{
 							w.writeNamespace(XENC11, QStringLiteral("xenc11"));
 							writeElement(w, XENC11, QStringLiteral("KeyDerivationMethod"), {{"Algorithm", CONCATKDF_MTH}}, [&]{
-								writeElement(w, XENC11, QStringLiteral("ConcatKDFParams"), {{"AlgorithmID", "00" + props.value("DocumentFormat").toUtf8().toHex()},
-									{"PartyUInfo", "00" + SsDer.toHex()}, {"PartyVInfo", "00" + k.cert.toDer().toHex()}
+								writeElement(w, XENC11, QStringLiteral("ConcatKDFParams"), {{"AlgorithmID", "00" + docFormat.toHex()},
+									{"PartyUInfo", "00" + wrapped.SsDer.toHex()}, {"PartyVInfo", "00" + wrapped.cert.toHex()}
 								}, [&]{
-									writeElement(w, DS, QStringLiteral("DigestMethod"), {{"Algorithm", concatDigest}});
+									writeElement(w, DS, QStringLiteral("DigestMethod"), {{"Algorithm", wrapped.concatDigest}});
 								});
 							});
 							writeElement(w, DENC, QStringLiteral("OriginatorKeyInfo"), [&]{
 								writeElement(w, DS, QStringLiteral("KeyValue"), [&]{
 									w.writeNamespace(DSIG11, QStringLiteral("dsig11"));
 									writeElement(w, DSIG11, QStringLiteral("ECKeyValue"), [&]{
-										writeElement(w, DSIG11, QStringLiteral("NamedCurve"), {{"URI", "urn:oid:" + oid}});
-										writeBase64Element(w, DSIG11, QStringLiteral("PublicKey"), SsDer);
+										writeElement(w, DSIG11, QStringLiteral("NamedCurve"), {{"URI", "urn:oid:" + wrapped.oid}});
+										writeBase64Element(w, DSIG11, QStringLiteral("PublicKey"), wrapped.SsDer);
 									});
 								});
 							});
 							writeElement(w, DENC, QStringLiteral("RecipientKeyInfo"), [&]{
 								writeElement(w, DS, QStringLiteral("X509Data"), [&]{
-									writeBase64Element(w, DS, QStringLiteral("X509Certificate"), k.cert.toDer());
+									writeBase64Element(w, DS, QStringLiteral("X509Certificate"), wrapped.cert);
 								});
 							});
 						});
 					});
 				}
 				writeElement(w, DENC, QStringLiteral("CipherData"), [&]{
-					writeBase64Element(w, DENC, QStringLiteral("CipherValue"), cipher);
+					writeBase64Element(w, DENC, QStringLiteral("CipherValue"), wrapped.cipher);
 				});
 			});
 		}});
 		writeElement(w,DENC, QStringLiteral("CipherData"), [&]{
-			writeBase64Element(w, DENC, QStringLiteral("CipherValue"), encryptedData);
+			writeElement(w, DENC, QStringLiteral("CipherValue"), [&]{
+				result = cipherValue(w);
+			});
 		});
 		writeElement(w, DENC, QStringLiteral("EncryptionProperties"), [&]{
 			for(QMultiHash<QString,QString>::const_iterator i = props.constBegin(); i != props.constEnd(); ++i)
@@ -732,45 +2060,100 @@ void CryptoDoc::Private::writeCDoc(QIODevice *cdoc, const QByteArray &transportK
 		});
 	});
 	w.writeEndDocument();
+	return result && !w.hasError();
 }
 
-void CryptoDoc::Private::readDDoc(QIODevice *ddoc)
+bool CryptoDoc::Private::isCompressible(const QList<File> &entries)
 {
-	qCDebug(CRYPTO) << "Parsing DDOC container";
-	files.clear();
-	QXmlStreamReader x(ddoc);
-	while(!x.atEnd())
+	// Bits per byte, compressed and encrypted data is close to 8
+	static const double MAX_ENTROPY = 7.5;
+	static const qint64 SAMPLE_SIZE = 1024 * 1024;
+	std::array<qint64,256> counts {};
+	qint64 total = 0;
+	for(const File &f: entries)
 	{
-		switch(x.readNext())
+		if(total >= SAMPLE_SIZE)
+			break;
+		const qint64 limit = qMin<qint64>(BLOCK_SIZE, SAMPLE_SIZE - total);
+		QByteArray sample;
+		if(!f.ddoc.isEmpty())
 		{
-		case QXmlStreamReader::StartElement: break;
-		case QXmlStreamReader::DTD:
-			qCWarning(CRYPTO) << "XML DTD Declarations are not supported";
-			return;
-		case QXmlStreamReader::EntityReference:
-			qCWarning(CRYPTO) << "XML ENTITY References are not supported";
-			return;
-		default: continue;
+			f.decode([&](const char *data, qint64 size) {
+				sample = QByteArray(data, int(qMin(size, limit)));
+				return false;
+			});
+		}
+		else if(f.path.isEmpty())
+			sample = f.data.left(int(limit));
+		else
+		{
+			QFile file(f.path);
+			if(file.open(QFile::ReadOnly))
+				sample = file.read(limit);
 		}
+		for(char c: qAsConst(sample))
+			++counts[uchar(c)];
+		total += sample.size();
+	}
+	if(total == 0)
+		return false;
+	double entropy = 0;
+	for(qint64 count: counts)
+	{
+		if(count == 0)
+			continue;
+		double p = double(count) / double(total);
+		entropy -= p * std::log2(p);
+	}
+	qCDebug(CRYPTO) << "Content entropy" << entropy << "bits per byte";
+	return entropy < MAX_ENTROPY;
+}
 
-		if(x.name() == QStringLiteral("DataFile"))
+QList<CryptoDoc::Private::File> CryptoDoc::Private::dataFiles() const
+{
+	QList<File> result;
+	QMimeDatabase mimes;
+	for(const File &file: files)
+	{
+		if(file.path.isEmpty() || !QFileInfo(file.path).isDir())
+		{
+			result << file;
+			continue;
+		}
+		QStringList paths;
+		QDirIterator it(file.path, QDir::Files|QDir::Hidden, QDirIterator::Subdirectories);
+		while(it.hasNext())
+			paths << it.next();
+		paths.sort();
+		const QDir dir(file.path);
+		for(const QString &path: qAsConst(paths))
 		{
-			File file;
-			file.name = x.attributes().value(QStringLiteral("Filename")).toString().normalized(QString::NormalizationForm_C);
-			file.id = x.attributes().value(QStringLiteral("Id")).toString().normalized(QString::NormalizationForm_C);
-			file.mime = x.attributes().value(QStringLiteral("MimeType")).toString().normalized(QString::NormalizationForm_C);
-			x.readNext();
-			file.data = fromBase64( x.text() );
-			file.size = FileDialog::fileSize(quint64(file.data.size()));
-			files << file;
+			File f;
+			f.name = file.name + '/' + dir.relativeFilePath(path);
+			f.mime = mimes.mimeTypeForFile(path, QMimeDatabase::MatchExtension).name();
+			f.path = path;
+			result << f;
 		}
-		else if(x.name() == QStringLiteral("Signature"))
-			hasSignature = true;
 	}
-	qCDebug(CRYPTO) << "Container contains signature" << hasSignature;
+	for(int i = 0; i < result.size(); ++i)
+		result[i].id = QStringLiteral("D%1").arg(i);
+	return result;
+}
+
+qint64 CryptoDoc::Private::ddocSize(const QList<File> &entries)
+{
+	// Markup does not depend on the content, only the encoded content size is added
+	QByteArray markup;
+	QBuffer buffer(&markup);
+	if(!buffer.open(QBuffer::WriteOnly) || !writeDDoc(&buffer, entries, false))
+		return -1;
+	qint64 result = markup.size();
+	for(const File &file: entries)
+		result += qint64(Base64Encoder::encodedSize(size_t(file.fileSize())));
+	return result;
 }
 
-void CryptoDoc::Private::writeDDoc(QIODevice *ddoc)
+bool CryptoDoc::Private::writeDDoc(QIODevice *ddoc, const QList<File> &entries, bool content)
 {
 	qCDebug(CRYPTO) << "Creating DDOC container";
 	QXmlStreamWriter x(ddoc);
@@ -780,17 +2163,26 @@ void CryptoDoc::Private::writeDDoc(QIODevice *ddoc)
 	x.writeStartElement(QStringLiteral("SignedDoc"));
 	writeAttributes(x, {{"format", "DIGIDOC-XML"}, {"version", "1.3"}});
 
-	for(const File &file: qAsConst(files))
+	for(const File &file: entries)
 	{
 		x.writeStartElement(QStringLiteral("DataFile"));
 		writeAttributes(x, {{"ContentType", "EMBEDDED_BASE64"}, {"Filename", file.name},
-			{"Id", file.id}, {"MimeType", file.mime}, {"Size", QString::number(file.data.size())}});
-		writeBase64(x, file.data);
+			{"Id", file.id}, {"MimeType", file.mime}, {"Size", QString::number(file.fileSize())}});
+		if(content)
+		{
+			Base64Writer base64(x);
+			ProgressDevice progress(&base64, [this](qint64 size) { return step(size); });
+			if(!file.write(&progress) || !base64.finalize())
+				return false;
+		}
+		else if(file.fileSize() > 0)
+			x.writeCharacters(QString()); // Closes the start tag like the content does
 		x.writeEndElement(); //DataFile
 	}
 
 	x.writeEndElement(); //SignedDoc
 	x.writeEndDocument();
+	return !x.hasError();
 }
 
 
@@ -807,14 +2199,19 @@ bool CDocumentModel::addFile(const QString &file, const QString &mime)
 		return false;
 
 	QFileInfo info(file);
-	if(info.size() == 0)
+	// Directory is archived to DDoc when encrypting, its files are only counted here
+	qint64 size = info.isDir() ? 0 : info.size();
+	if(info.isDir())
 	{
-		WarningDialog(tr("Cannot add empty file to the container."), qApp->mainWindow()).exec();
-		return false;
+		for(QDirIterator it(file, QDir::Files|QDir::Hidden, QDirIterator::Subdirectories); it.hasNext();)
+		{
+			it.next();
+			size += it.fileInfo().size();
+		}
 	}
-	if(info.size() > 120*1024*1024)
+	if(size == 0)
 	{
-		WarningDialog(tr("Added file(s) exceeds the maximum size limit of the container(120MB)."), qApp->activeWindow()).exec();
+		WarningDialog(tr("Cannot add empty file to the container."), qApp->mainWindow()).exec();
 		return false;
 	}
 
@@ -830,14 +2227,18 @@ bool CDocumentModel::addFile(const QString &file, const QString &mime)
 		}
 	}
 
-	QFile data(file);
-	data.open(QFile::ReadOnly);
+	if(!info.isReadable())
+	{
+		d->setLastError(tr("Failed to open file '%1'").arg(FileDialog::normalized(fileName)));
+		return false;
+	}
+
 	CryptoDoc::Private::File f;
 	f.id = QStringLiteral("D%1").arg(d->files.size());
 	f.mime = mime;
-	f.name = QFileInfo(file).fileName();
-	f.data = data.readAll();
-	f.size = FileDialog::fileSize(quint64(f.data.size()));
+	f.name = fileName;
+	f.path = info.absoluteFilePath();
+	f.size = FileDialog::fileSize(quint64(size));
 	d->files << f;
 	emit added(FileDialog::normalized(f.name));
 	return true;
@@ -851,11 +2252,29 @@ void CDocumentModel::addTempReference(const QString &file)
 QString CDocumentModel::copy(int row, const QString &dst) const
 {
 	const CryptoDoc::Private::File &file = d->files.at(row);
+	if(!file.path.isEmpty() && QFileInfo(file.path).isDir())
+	{
+		// Directory is copied file by file, like it is packed to DDoc when encrypting
+		const QDir dir(file.path);
+		for(QDirIterator it(file.path, QDir::Files|QDir::Hidden, QDirIterator::Subdirectories); it.hasNext();)
+		{
+			const QString target = dst + '/' + dir.relativeFilePath(it.next());
+			if(QFile::exists(target))
+				QFile::remove(target);
+			if(!QDir().mkpath(QFileInfo(target).absolutePath()) || !QFile::copy(it.filePath(), target))
+			{
+				d->setLastError( tr("Failed to save file '%1'").arg( target ) );
+				return {};
+			}
+		}
+		return dst;
+	}
 	if( QFile::exists( dst ) )
 		QFile::remove( dst );
 
+	// Files of DDoc keep their relative path
 	QFile f(dst);
-	if(!f.open(QFile::WriteOnly) || f.write(file.data) < 0)
+	if(!QDir().mkpath(QFileInfo(dst).absolutePath()) || !f.open(QFile::WriteOnly) || !file.write(&f))
 	{
 		d->setLastError( tr("Failed to save file '%1'").arg( dst ) );
 		return {};
@@ -882,7 +2301,13 @@ void CDocumentModel::open(int row)
 {
 	if(d->encrypted)
 		return;
-	QString path = FileDialog::tempPath(FileDialog::safeName(data(row)));
+	const CryptoDoc::Private::File &file = d->files.at(row);
+	if(!file.path.isEmpty() && QFileInfo(file.path).isDir())
+	{
+		QDesktopServices::openUrl(QUrl::fromLocalFile(file.path));
+		return;
+	}
+	QString path = FileDialog::tempPath(FileDialog::safePath(data(row)));
 	if(!verifyFile(path))
 		return;
 	QFileInfo f(copy(row, path));
@@ -940,9 +2365,77 @@ QString CDocumentModel::save(int row, const QString &path) const
 
 
 
+struct CKey::Info
+{
+	explicit Info(const QByteArray &der)
+	{
+		pcuchar p = pcuchar(der.constData());
+		auto x509 = SCOPE(X509, d2i_X509(nullptr, &p, der.size()));
+		if(!x509)
+			return;
+		key.reset(X509_get_pubkey(x509.get()));
+		switch(EVP_PKEY_base_id(key.get()))
+		{
+		case EVP_PKEY_RSA:
+			algorithm = QSsl::Rsa;
+			break;
+		case EVP_PKEY_EC:
+			algorithm = QSsl::Ec;
+			curve = EC_GROUP_get_curve_name(EC_KEY_get0_group(EVP_PKEY_get0_EC_KEY(key.get())));
+			break;
+		default: break;
+		}
+	}
+
+	std::unique_ptr<EVP_PKEY,decltype(&EVP_PKEY_free)> key{nullptr, EVP_PKEY_free};
+	QSsl::KeyAlgorithm algorithm = QSsl::Opaque;
+	int curve = NID_undef;
+};
+
+struct CKey::Data
+{
+	QByteArray der;
+	QSslCertificate cert;
+	std::shared_ptr<const Info> info;
+	std::once_flag certOnce, infoOnce;
+};
+
+QSslCertificate CKey::cert() const
+{
+	if(!d)
+		return {};
+	std::call_once(d->certOnce, [this] {
+		if(d->cert.isNull() && !d->der.isEmpty())
+			d->cert = QSslCertificate(d->der, QSsl::Der);
+	});
+	return d->cert;
+}
+
+QByteArray CKey::der() const
+{
+	return d ? d->der : QByteArray();
+}
+
+std::shared_ptr<const CKey::Info> CKey::info() const
+{
+	if(!d)
+		return std::make_shared<const Info>(QByteArray());
+	std::call_once(d->infoOnce, [this] {
+		d->info = std::make_shared<const Info>(d->der);
+	});
+	return d->info;
+}
+
+void CKey::setDer( const QByteArray &der )
+{
+	d = std::make_shared<Data>();
+	d->der = der;
+}
+
 void CKey::setCert( const QSslCertificate &c )
 {
-	cert = c;
+	setDer(c.toDer());
+	d->cert = c;
 	recipient = [](const SslCertificate &c) {
 		QString cn = c.subjectInfo(QSslCertificate::CommonName);
 		QString o = c.subjectInfo(QSslCertificate::Organization);
@@ -972,6 +2465,7 @@ CryptoDoc::CryptoDoc( QObject *parent )
 	, containerState(UnencryptedContainer)
 {
 	d->documents = new CDocumentModel( d );
+	connect(d, &Private::progress, this, &CryptoDoc::progress);
 }
 
 CryptoDoc::~CryptoDoc() { clear(); delete d; }
@@ -980,35 +2474,41 @@ bool CryptoDoc::addKey( const CKey &key )
 {
 	if( d->isEncryptedWarning() )
 		return false;
-	if( d->keys.contains( key ) )
+	const QByteArray der = key.der();
+	if(d->keyIndex.contains(Private::fingerprint(der)))
 	{
 		d->setLastError( tr("Key already exists") );
 		return false;
 	}
+	d->indexKey(der, d->keys.size());
 	d->keys << key;
 	return true;
 }
 
+void CryptoDoc::cancel()
+{
+	d->cancelled = true;
+}
+
 bool CryptoDoc::canDecrypt(const QSslCertificate &cert)
 {
-	if(cert.isNull())
+	if(cert.isNull() || !Private::ENC_MTH.contains(d->method))
 		return false;
-	for(const CKey &k: qAsConst(d->keys))
-	{
-		if(!Private::ENC_MTH.contains(d->method) || k.cert != cert)
-			continue;
-		if(cert.publicKey().algorithm() == QSsl::Rsa &&
-				!k.cipher.isEmpty() &&
-				k.method == Private::RSA_MTH)
-			return true;
-		if(cert.publicKey().algorithm() == QSsl::Ec &&
-				!k.publicKey.isEmpty() &&
-				!k.cipher.isEmpty() &&
-				Private::KWAES_SIZE.contains(k.method) &&
-				k.derive ==  Private::CONCATKDF_MTH &&
-				k.agreement ==  Private::AGREEMENT_MTH)
-			return true;
-	}
+	const CKey *k = d->findKey(cert);
+	if(!k)
+		return false;
+	const QSsl::KeyAlgorithm algorithm = k->info()->algorithm;
+	if(algorithm == QSsl::Rsa &&
+			!k->cipher.isEmpty() &&
+			k->method == Private::RSA_MTH)
+		return true;
+	if(algorithm == QSsl::Ec &&
+			!k->publicKey.isEmpty() &&
+			!k->cipher.isEmpty() &&
+			Private::KWAES_SIZE.contains(k->method) &&
+			k->derive ==  Private::CONCATKDF_MTH &&
+			k->agreement ==  Private::AGREEMENT_MTH)
+		return true;
 	return false;
 }
 
@@ -1042,7 +2542,6 @@ QByteArray CryptoDoc::concatKDF(const QString &digestMethod, quint32 keyDataLen,
 
 void CryptoDoc::clear( const QString &file )
 {
-	delete d->ddoc;
 	for(const QString &f: qAsConst(d->tempFiles))
 	{
 #if defined(Q_OS_WIN)
@@ -1052,15 +2551,21 @@ void CryptoDoc::clear( const QString &file )
 		QFile::remove(f);
 	}
 	d->tempFiles.clear();
-	d->ddoc = nullptr;
+	d->ddoc.clear();
 	d->hasSignature = false;
 	d->encrypted = false;
 	d->fileName = file;
 	d->files.clear();
 	d->keys.clear();
+	d->keyIndex.clear();
 	d->properties.clear();
+	d->origFiles.clear();
 	d->method.clear();
 	d->mime.clear();
+	d->cipherText.clear();
+	d->cipherPos = -1;
+	d->cipherSize = 0;
+	d->binary = false;
 }
 
 ContainerState CryptoDoc::state() const
@@ -1077,63 +2582,132 @@ bool CryptoDoc::decrypt()
 	}
 	if( !d->encrypted )
 		return true;
+	return decrypt({ this }) == 1;
+}
+
+int CryptoDoc::decrypt(const QList<CryptoDoc*> &docs)
+{
+	int result = 0;
+	auto setLastError = [&docs](CryptoDoc *doc, const QString &error) {
+		doc->d->lastError = error;
+		if(docs.size() == 1 && !error.isEmpty())
+			doc->d->setLastError(error);
+	};
+	QList<QPair<CryptoDoc*,CKey>> pending;
+	const QSslCertificate cert = qApp->signer()->tokenauth().cert();
+	for(CryptoDoc *doc: docs)
+	{
+		doc->d->cancelled = false;
+		doc->d->lastError.clear();
+		if(doc->d->fileName.isEmpty())
+			setLastError(doc, tr("Container is not open"));
+		else if(!doc->d->encrypted)
+			++result;
+		else if(const CKey *key = cert.isNull() ? nullptr : doc->d->findKey(cert))
+			pending.append({ doc, *key });
+		else
+			setLastError(doc, tr("You do not have the key to decrypt this document"));
+	}
+	if(pending.isEmpty() || qApp->signer()->beginDecrypt() != QSigner::DecryptOK)
+		return result;
 
-	CKey key;
-	for(const CKey &k: qAsConst(d->keys))
+	// Payloads are decrypted in the shared thread pool while the token unwraps the next transport key,
+	// so the number of documents decrypted at once is bounded like other parallel work
+	QThreadPool *pool = QThreadPool::globalInstance();
+	QEventLoop e;
+	int running = 0;
+	QList<CryptoDoc*> started;
+	std::vector<std::unique_ptr<ParallelTask>> tasks;
+	for(const QPair<CryptoDoc*,CKey> &item: qAsConst(pending))
 	{
-		if( qApp->signer()->tokenauth().cert() == k.cert )
+		CryptoDoc *doc = item.first;
+		// Cancel may arrive while the PIN is asked or the key is unwrapped
+		if(doc->d->cancelled)
+			continue;
+		if(!doc->d->unwrapKey(item.second))
 		{
-			key = k;
-			break;
+			// Token errors are shown by the signer
+			if(docs.size() > 1)
+				setLastError(doc, tr("Failed to decrypt the key of this document"));
+			continue;
 		}
+		if(doc->d->cancelled)
+			continue;
+		doc->d->reset();
+		tasks.emplace_back(new ParallelTask([d = doc->d, &running, &e] {
+			d->run();
+			QMetaObject::invokeMethod(&e, [&running, &e] {
+				if(--running == 0)
+					e.quit();
+			}, Qt::QueuedConnection);
+		}));
+		++running;
+		started << doc;
+		pool->start(tasks.back().get());
 	}
-	if( key.cert.isNull() )
+	qApp->signer()->endDecrypt();
+	if(running > 0)
+		e.exec();
+
+	for(CryptoDoc *doc: qAsConst(started))
 	{
-		d->setLastError( tr("You do not have the key to decrypt this document") );
-		return false;
+		setLastError(doc, doc->d->lastError);
+		doc->containerState = doc->d->encrypted ? EncryptedContainer : UnencryptedContainer;
+		if(!doc->d->encrypted)
+			++result;
 	}
+	return result;
+}
 
-	bool decrypted = false;
-	bool isECDH = key.cert.publicKey().algorithm() == QSsl::Ec;
-	QByteArray decryptedKey;
-	while( !decrypted )
+bool CryptoDoc::decryptFile(const QString &cdoc, const QString &folder,
+	const std::function<QByteArray(const QList<CKey> &keys)> &transportKey, QString &error)
+{
+	Private d;
+	d.fileName = cdoc;
+	QFile file(cdoc);
+	if(!file.open(QFile::ReadOnly) ||
+		(file.peek(Private::BINARY_MAGIC.size()) == Private::BINARY_MAGIC ? !d.readBinary(&file) : !d.readCDoc(&file)))
 	{
-		switch(qApp->signer()->decrypt(isECDH ? key.publicKey : key.cipher, decryptedKey,
-			key.concatDigest, int(Private::KWAES_SIZE[key.method]), key.AlgorithmID, key.PartyUInfo, key.PartyVInfo))
-		{
-		case QSigner::DecryptOK: decrypted = true; break;
-		case QSigner::PinIncorrect: break;
-		default: return false;
-		}
+		error = tr("Error parsing document");
+		return false;
 	}
-	if(isECDH)
+	file.close();
+	d.key = transportKey(d.keys);
+	if(d.key.isEmpty())
 	{
-#ifndef NDEBUG
-		qDebug() << "DEC Ss" << key.publicKey.toHex();
-		qDebug() << "DEC ConcatKDF" << decryptedKey.toHex();
-#endif
-		d->key = d->AES_wrap(decryptedKey, key.cipher, false);
-		d->opensslError(d->key.isEmpty());
+		error = tr("You do not have the key to decrypt this document");
+		return false;
 	}
-	else // RSA decrypts directly transport key
-		d->key = decryptedKey;
-#ifndef NDEBUG
-	qDebug() << "DEC transport" << d->key.toHex();
-#endif
-
-	d->waitForFinished();
-	if( !d->lastError.isEmpty() )
-		d->setLastError( d->lastError );
-	
-	containerState = d->encrypted ? EncryptedContainer : UnencryptedContainer;
 
-	return !d->encrypted;
+	d.encrypted = true;
+	// run decryption in calling thread
+	d.run();
+	error = d.lastError;
+	const QDir dir(folder);
+	for(const Private::File &f: qAsConst(d.files))
+	{
+		if(!error.isEmpty())
+			break;
+		const QString dst = dir.filePath(FileDialog::safePath(f.name));
+		QFile out(dst);
+		if(out.exists())
+			error = tr("Failed to save file '%1'").arg(dst);
+		else if(!QDir().mkpath(QFileInfo(dst).absolutePath()) || !out.open(QFile::WriteOnly) || !f.write(&out))
+		{
+			out.remove();
+			error = tr("Failed to save file '%1'").arg(dst);
+		}
+	}
+	for(const QString &tmp: qAsConst(d.tempFiles))
+		QFile::remove(tmp);
+	return error.isEmpty();
 }
 
 DocumentModel* CryptoDoc::documentModel() const { return d->documents; }
 
 bool CryptoDoc::encrypt( const QString &filename )
 {
+	d->cancelled = false;
 	if( !filename.isEmpty() )
 		d->fileName = filename;
 	if( d->fileName.isEmpty() )
@@ -1149,20 +2723,111 @@ bool CryptoDoc::encrypt( const QString &filename )
 		return false;
 	}
 
+	d->options = EncryptOptions::fromSettings();
 	d->waitForFinished();
 	if( !d->lastError.isEmpty() )
 		d->setLastError( d->lastError );
-	open(d->fileName);
+	else if( !d->cancelled )
+		open(d->fileName);
 
 	containerState = d->encrypted ? EncryptedContainer : UnencryptedContainer;
 
 	return d->encrypted;
 }
 
+CryptoDoc::EncryptOptions CryptoDoc::EncryptOptions::fromSettings()
+{
+	QSettings s;
+	EncryptOptions options;
+	options.legacy = s.value(QStringLiteral("cdocwithddoc"), false).toBool();
+	options.binary = s.value(QStringLiteral("cdocbinary"), false).toBool();
+	options.compress = s.value(QStringLiteral("cdoccompress"), false).toBool();
+	return options;
+}
+
+bool CryptoDoc::encryptFile(const QString &file, const QString &cdoc, const QList<CKey> &keys,
+	const EncryptOptions &options, QString &error)
+{
+	QFileInfo info(file);
+	if(!info.isReadable())
+	{
+		error = tr("Failed to open file '%1'").arg(file);
+		return false;
+	}
+	if(!info.isDir() && info.size() == 0)
+	{
+		error = tr("Cannot add empty file to the container.");
+		return false;
+	}
+	if(keys.isEmpty())
+	{
+		error = tr("No keys specified");
+		return false;
+	}
+
+	Private::File f;
+	f.id = QStringLiteral("D0");
+	f.mime = QStringLiteral("application/octet-stream");
+	f.name = info.fileName();
+	f.path = info.absoluteFilePath();
+	f.size = FileDialog::fileSize(quint64(info.size()));
+
+	Private d;
+	d.fileName = cdoc;
+	d.keys = keys;
+	d.options = options;
+	d.files << f;
+	// run encryption in calling thread
+	d.run();
+	error = d.lastError;
+	return error.isEmpty();
+}
+
+QJsonObject CryptoDoc::inventory(const QString &file)
+{
+	QJsonObject result{{QStringLiteral("file"), file}};
+	QFile cdoc(file);
+	if(!cdoc.open(QFile::ReadOnly))
+	{
+		result[QStringLiteral("error")] = cdoc.errorString();
+		return result;
+	}
+	Private d;
+	if(cdoc.peek(Private::BINARY_MAGIC.size()) == Private::BINARY_MAGIC ? !d.readBinary(&cdoc) : !d.readCDoc(&cdoc, true))
+	{
+		result[QStringLiteral("error")] = tr("Error parsing document");
+		return result;
+	}
+
+	QJsonArray recipients;
+	for(const CKey &k: qAsConst(d.keys))
+	{
+		recipients.append(QJsonObject{
+			{QStringLiteral("recipient"), k.recipient},
+			{QStringLiteral("name"), k.name},
+			{QStringLiteral("method"), k.method},
+			{QStringLiteral("fingerprint"), QString::fromLatin1(Private::fingerprint(k.der()).toHex())},
+		});
+	}
+	QJsonArray files;
+	for(const Private::File &f: qAsConst(d.files))
+		files.append(f.name);
+	if(files.isEmpty() && d.properties.contains(QStringLiteral("Filename")))
+		files.append(d.properties[QStringLiteral("Filename")]);
+	result[QStringLiteral("method")] = d.method;
+	result[QStringLiteral("mime")] = d.mime;
+	result[QStringLiteral("documentFormat")] = d.properties.value(QStringLiteral("DocumentFormat"));
+	result[QStringLiteral("binary")] = d.binary;
+	result[QStringLiteral("files")] = files;
+	result[QStringLiteral("recipients")] = recipients;
+	return result;
+}
+
 QString CryptoDoc::fileName() const { return d->fileName; }
 bool CryptoDoc::isEncrypted() const { return d->encrypted; }
 bool CryptoDoc::isNull() const { return d->fileName.isEmpty(); }
 bool CryptoDoc::isSigned() const { return d->hasSignature; }
+QString CryptoDoc::lastError() const { return d->lastError; }
 
 QList<CKey> CryptoDoc::keys() const
 {
@@ -1193,7 +2858,10 @@ bool CryptoDoc::open( const QString &file )
 	clear(file);
 	QFile cdoc(d->fileName);
 	cdoc.open(QFile::ReadOnly);
-	d->readCDoc(&cdoc, false);
+	if(cdoc.peek(Private::BINARY_MAGIC.size()) == Private::BINARY_MAGIC)
+		d->readBinary(&cdoc);
+	else
+		d->readCDoc(&cdoc);
 	cdoc.close();
 
 	if(d->files.isEmpty() && d->properties.contains(QStringLiteral("Filename")))
@@ -1211,10 +2879,60 @@ bool CryptoDoc::open( const QString &file )
 	return !d->keys.isEmpty();
 }
 
+bool CryptoDoc::rekey(const QList<CKey> &keys)
+{
+	d->cancelled = false;
+	if(d->fileName.isEmpty())
+	{
+		d->setLastError(tr("Container is not open"));
+		return false;
+	}
+	if(!d->encrypted)
+	{
+		d->setLastError(tr("Container is not encrypted"));
+		return false;
+	}
+	if(keys.isEmpty())
+	{
+		d->setLastError(tr("No keys specified"));
+		return false;
+	}
+	const QSslCertificate cert = qApp->signer()->tokenauth().cert();
+	const CKey *key = cert.isNull() ? nullptr : d->findKey(cert);
+	if(!key)
+	{
+		d->setLastError(tr("You do not have the key to decrypt this document"));
+		return false;
+	}
+	if(!d->unwrapKey(*key))
+		return false;
+	if(d->cancelled)
+	{
+		d->key.clear();
+		return false;
+	}
+
+	// Payload is copied or re-sealed on the document thread, progress is reported like for decrypt
+	d->newKeys = keys;
+	d->waitForFinished();
+	d->newKeys.clear();
+	d->key.clear();
+	if(!d->lastError.isEmpty())
+	{
+		d->setLastError(d->lastError);
+		return false;
+	}
+	return !d->cancelled && open(d->fileName);
+}
+
 void CryptoDoc::removeKey( int id )
 {
-	if( !d->isEncryptedWarning() )
-		d->keys.removeAt(id);
+	if( d->isEncryptedWarning() )
+		return;
+	d->keys.removeAt(id);
+	d->keyIndex.clear();
+	for(int i = 0; i < d->keys.size(); ++i)
+		d->indexKey(d->keys.at(i).der(), i);
 }
 
 bool CryptoDoc::saveCopy(const QString &filename)
@@ -1228,13 +2946,17 @@ bool CryptoDoc::saveCopy(const QString &filename)
 
 bool CryptoDoc::saveDDoc( const QString &filename )
 {
-	if( !d->ddoc )
+	if( d->ddoc.isEmpty() )
 	{
 		d->setLastError( tr("Document not open") );
 		return false;
 	}
 
-	bool result = d->ddoc->copy( filename );
+	// Copied by content, temporary file is readable only by the owner
+	CryptoDoc::Private::File ddoc;
+	ddoc.path = d->ddoc;
+	QFile f(filename);
+	bool result = !f.exists() && f.open(QFile::WriteOnly) && ddoc.write(&f);
 	if( !result )
 		d->setLastError( tr("Failed to save file") );
 	return result;
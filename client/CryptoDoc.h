@@ -22,34 +22,62 @@
 #include "common_enums.h"
 #include "DocumentModel.h"
 
+#include <QtCore/QJsonObject>
 #include <QtCore/QStringList>
 #include <QtNetwork/QSslCertificate>
 
+#include <functional>
+#include <memory>
+
 class CKey
 {
 public:
 	CKey() = default;
 	CKey( const QSslCertificate &cert ) { setCert( cert ); }
+	// Certificate is decoded from DER on first call and shared between copies of the key
+	QSslCertificate cert() const;
+	QByteArray der() const;
 	void setCert( const QSslCertificate &cert );
-	bool operator==( const CKey &other ) const { return other.cert == cert; }
+	void setDer( const QByteArray &der );
+	bool operator==( const CKey &other ) const { return other.der() == der(); }
+
+	// Certificate data parsed once and shared between copies of the key
+	struct Info;
+	std::shared_ptr<const Info> info() const;
 
-	QSslCertificate cert;
 	QString id, name, recipient, method, agreement, derive, concatDigest;
 	QByteArray AlgorithmID, PartyUInfo, PartyVInfo;
 	QByteArray cipher, publicKey;
+
+private:
+	struct Data;
+	std::shared_ptr<Data> d;
 };
 
 class CryptoDoc: public QObject
 {
 	Q_OBJECT
 public:
+	// Format of new documents, encryption itself does not read settings
+	struct EncryptOptions
+	{
+		bool legacy = false; // CDOC 1.0 with DDoc container for DigiDoc3 Crypto 3.8 and earlier
+		bool binary = false; // Binary CDOC 1.1, not supported by other clients
+		bool compress = false; // Compress compressible content before encrypting
+		static EncryptOptions fromSettings();
+	};
+
 	CryptoDoc(QObject *parent = nullptr);
 	~CryptoDoc() final;
 
 	bool addKey( const CKey &key );
+	void cancel();
 	bool canDecrypt(const QSslCertificate &cert);
 	void clear( const QString &file = QString() );
 	bool decrypt();
+	// Decrypts documents with single token login, returns count of decrypted documents.
+	// Errors are shown for single document, with several documents they are left in lastError().
+	static int decrypt(const QList<CryptoDoc*> &docs);
 	DocumentModel* documentModel() const;
 	bool encrypt( const QString &filename = QString() );
 	QString fileName() const;
@@ -58,8 +86,12 @@ public:
 	bool isNull() const;
 	bool isSigned() const;
 	QList<CKey> keys() const;
+	QString lastError() const;
 	bool move(const QString &to);
 	bool open( const QString &file );
+	// Replaces recipients of encrypted document, payload is copied without decrypting it.
+	// Runs on the document thread and reports progress like decrypt().
+	bool rekey(const QList<CKey> &keys);
 	void removeKey( int id );
 	bool saveCopy(const QString &filename);
 	bool saveDDoc( const QString &filename );
@@ -67,6 +99,18 @@ public:
 
 	static QByteArray concatKDF(const QString &digestMethod,
 		quint32 keyDataLen, const QByteArray &z, const QByteArray &otherInfo);
+	// Encrypts a single file without user interface, safe to call from worker threads
+	static bool encryptFile(const QString &file, const QString &cdoc, const QList<CKey> &keys,
+		const EncryptOptions &options, QString &error);
+	// Decrypts document to folder without user interface, transportKey unwraps the key of one of the recipients.
+	// Existing files are not overwritten, safe to call from worker threads
+	static bool decryptFile(const QString &cdoc, const QString &folder,
+		const std::function<QByteArray(const QList<CKey> &keys)> &transportKey, QString &error);
+	// Lists recipients and properties of document without reading the payload, safe to call from worker threads
+	static QJsonObject inventory(const QString &file);
+
+signals:
+	void progress(qint64 done, qint64 total);
 
 private:
 	class Private;
@@ -32,13 +32,26 @@
 #include <digidocpp/Signature.h>
 #include <digidocpp/crypto/X509Cert.h>
 
+#include <QtCore/QCryptographicHash>
 #include <QtCore/QDateTime>
+#include <QtCore/QDir>
 #include <QtCore/QFileInfo>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QJsonObject>
+#include <QtCore/QMutex>
+#include <QtCore/QPointer>
+#include <QtCore/QRunnable>
+#include <QtCore/QSaveFile>
+#include <QtCore/QSemaphore>
+#include <QtCore/QStandardPaths>
 #include <QtCore/QStringList>
+#include <QtCore/QThreadPool>
 #include <QtCore/QUrl>
 #include <QtGui/QDesktopServices>
 
 #include <algorithm>
+#include <atomic>
+#include <vector>
 
 #if defined(Q_OS_WIN)
 #include <qt_windows.h>
@@ -51,27 +64,240 @@ using namespace ria::qdigidoc4;
 static std::string to(const QString &str) { return str.toStdString(); }
 static QString from(const std::string &str) { return FileDialog::normalized(QString::fromStdString(str)); }
 
+// Identifies the container file for the validation cache without reading its content,
+// signature values in the cache key tell apart files replaced with the same size and time
+static QByteArray fileKey(const QString &path)
+{
+	QFileInfo info(path);
+	if(!info.exists())
+		return {};
+	return QCryptographicHash::hash(QStringLiteral("%1:%2:%3").arg(info.canonicalFilePath())
+		.arg(info.size()).arg(info.lastModified().toMSecsSinceEpoch()).toUtf8(), QCryptographicHash::Sha256);
+}
+
+static QString tslVersion()
+{
+	QDir dir(Application::confValue(Application::TSLCache).toString());
+	QStringList versions;
+	for(const QString &file: dir.entryList({QStringLiteral("*.xml")}, QDir::Files, QDir::Name))
+		versions << QStringLiteral("%1=%2").arg(file).arg(Application::readTSLVersion(dir.filePath(file)));
+	return versions.join(',');
+}
+
+// libdigidocpp signatures are validated one at a time, by the validation pool or by DigiDocSignature::validate()
+static QMutex validationLock;
+static std::atomic<bool> validationsCancelled{false};
+
+static QThreadPool* validationPool()
+{
+	static struct Pool: QThreadPool { Pool() { setMaxThreadCount(1); } } pool;
+	return &pool;
+}
+
+class ValidationTask final: public QRunnable
+{
+public:
+	explicit ValidationTask(std::function<void()> function) : function(std::move(function)) {}
+	void run() final { function(); }
+private:
+	std::function<void()> function;
+};
+
+static bool hasCode(const Exception &e, std::initializer_list<Exception::ExceptionCode> codes)
+{
+	if(std::find(codes.begin(), codes.end(), e.code()) != codes.end())
+		return true;
+	for(const Exception &child: e.causes())
+	{
+		if(hasCode(child, codes))
+			return true;
+	}
+	return false;
+}
+
+// Validation results by container and signature, dropped when the loaded TSL versions change.
+// Changes are written to disk by save(), least recently used entries are dropped above MAX_ENTRIES.
+class ValidationCache
+{
+public:
+	struct Result
+	{
+		DigiDocSignature::SignatureStatus status;
+		unsigned int warning;
+		QString lastError;
+	};
+
+	static ValidationCache& instance()
+	{
+		static ValidationCache cache;
+		return cache;
+	}
+
+	bool find(const QString &key, Result &result)
+	{
+		QMutexLocker locker(&m);
+		if(!checked || !entries.contains(key))
+			return false;
+		QJsonObject entry = entries.value(key).toObject();
+		result.status = DigiDocSignature::SignatureStatus(entry.value(QLatin1String("status")).toInt());
+		result.warning = unsigned(entry.value(QLatin1String("warning")).toInt());
+		result.lastError = entry.value(QLatin1String("lastError")).toString();
+		entry[QLatin1String("time")] = QDateTime::currentSecsSinceEpoch();
+		entries.insert(key, entry);
+		dirty = true;
+		return true;
+	}
+
+	void insert(const QString &key, const Result &result)
+	{
+		QMutexLocker locker(&m);
+		if(!checked)
+			return;
+		entries.insert(key, QJsonObject{
+			{QLatin1String("status"), int(result.status)},
+			{QLatin1String("warning"), int(result.warning)},
+			{QLatin1String("lastError"), result.lastError},
+			{QLatin1String("time"), QDateTime::currentSecsSinceEpoch()},
+		});
+		dirty = true;
+	}
 
+	void save()
+	{
+		QMutexLocker locker(&m);
+		if(!dirty)
+			return;
+		dirty = false;
+		if(entries.size() > MAX_ENTRIES)
+		{
+			std::vector<std::pair<qint64,QString>> used;
+			for(auto i = entries.constBegin(); i != entries.constEnd(); ++i)
+				used.emplace_back(i.value().toObject().value(QLatin1String("time")).toVariant().toLongLong(), i.key());
+			std::sort(used.begin(), used.end());
+			for(size_t i = 0, count = size_t(entries.size() - MAX_ENTRIES); i < count; ++i)
+				entries.remove(used[i].second);
+		}
+		QDir().mkpath(QFileInfo(path).absolutePath());
+		QSaveFile f(path);
+		if(!f.open(QFile::WriteOnly))
+			return;
+		f.write(QJsonDocument(QJsonObject{
+			{QLatin1String("tsl"), tsl},
+			{QLatin1String("signatures"), entries},
+		}).toJson(QJsonDocument::Compact));
+		f.commit();
+	}
+
+	// Called before each validation run, entries are not used until the loaded TSL versions are known
+	void setTSLVersion(const QString &version)
+	{
+		QMutexLocker locker(&m);
+		checked = true;
+		if(version == tsl)
+			return;
+		tsl = version;
+		entries = {};
+		dirty = true;
+	}
+
+private:
+	static constexpr int MAX_ENTRIES = 1000;
+
+	ValidationCache()
+		: path(QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + QStringLiteral("/signatures.json"))
+	{
+		QFile f(path);
+		if(!f.open(QFile::ReadOnly))
+			return;
+		QJsonObject obj = QJsonDocument::fromJson(f.readAll()).object();
+		tsl = obj.value(QLatin1String("tsl")).toString();
+		entries = obj.value(QLatin1String("signatures")).toObject();
+	}
+
+	QMutex m;
+	QString path, tsl;
+	QJsonObject entries;
+	bool checked = false, dirty = false;
+};
+
+
+
+struct DigiDocSignature::Data
+{
+	QSslCertificate cert, ocspCert, tsCert, tsaCert;
+	QDateTime claimedTime, ocspTime, trustedTime, tsTime, tsaTime;
+	QString id, policy, profile, signatureMethod, signedBy, spuri;
+	QStringList locations, roles;
+	QByteArray messageImprint;
+};
 
 DigiDocSignature::DigiDocSignature(const digidoc::Signature *signature, const DigiDoc *parent, bool isTimeStamped)
 	: s(signature)
 	, m_parent(parent)
 	, m_isTimeStamped(isTimeStamped)
-{}
+{
+	auto data = std::make_shared<Data>();
+	data->cert = toCertificate(s->signingCertificate());
+	data->ocspCert = toCertificate(s->OCSPCertificate());
+	data->tsCert = toCertificate(s->TimeStampCertificate());
+	data->tsaCert = toCertificate(s->ArchiveTimeStampCertificate());
+	data->claimedTime = toTime(s->claimedSigningTime());
+	data->ocspTime = toTime(s->OCSPProducedAt());
+	data->trustedTime = toTime(s->trustedSigningTime());
+	data->tsTime = toTime(s->TimeStampTime());
+	data->tsaTime = toTime(s->ArchiveTimeStampTime());
+	data->id = from(s->id());
+	data->policy = from(s->policy());
+	data->profile = from(s->profile());
+	data->signatureMethod = from(s->signatureMethod());
+	data->signedBy = from(s->signedBy());
+	data->spuri = from(s->SPUri());
+	data->locations = QStringList{
+		from( s->city() ).trimmed(),
+		from( s->stateOrProvince() ).trimmed(),
+		from( s->postalCode() ).trimmed(),
+		from( s->countryName() ).trimmed()};
+	for(const std::string &role: s->signerRoles())
+		data->roles << from( role ).trimmed();
+	std::vector<unsigned char> imprint = s->messageImprint();
+	data->messageImprint = QByteArray((const char *)imprint.data(), int(imprint.size()));
+	d = std::move(data);
+}
+
+QString DigiDocSignature::cacheKey() const
+{
+	if(m_parent->m_fileKey.isEmpty() || m_parent->isModified())
+		return {};
+	// Timestamps of the outer container may share ids with the signatures of the inner container
+	bool isTimestamp = false;
+	if(m_parent->parentContainer)
+	{
+		const std::vector<Signature*> list = m_parent->parentContainer->signatures();
+		isTimestamp = std::find(list.cbegin(), list.cend(), s) != list.cend();
+	}
+	QCryptographicHash values(QCryptographicHash::Sha256);
+	values.addData(d->cert.toDer());
+	values.addData(d->ocspCert.toDer());
+	values.addData(d->tsCert.toDer());
+	values.addData(QStringLiteral("%1/%2/%3").arg(d->claimedTime.toString(Qt::ISODate),
+		d->ocspTime.toString(Qt::ISODate), d->tsTime.toString(Qt::ISODate)).toUtf8());
+	return QStringLiteral("%1/%2%3/%4").arg(QString::fromLatin1(m_parent->m_fileKey.toHex()),
+		isTimestamp ? QStringLiteral("T:") : QString(), id(), QString::fromLatin1(values.result().toHex()));
+}
 
 QSslCertificate DigiDocSignature::cert() const
 {
-	return toCertificate(s->signingCertificate());
+	return d->cert;
 }
 
 QDateTime DigiDocSignature::claimedTime() const
 {
-	return toTime(s->claimedSigningTime());
+	return d->claimedTime;
 }
 
 QString DigiDocSignature::id() const
 {
-	return from(s->id());
+	return d->id;
 }
 
 QString DigiDocSignature::lastError() const { return m_lastError; }
@@ -85,27 +311,22 @@ QString DigiDocSignature::location() const
 
 QStringList DigiDocSignature::locations() const
 {
-	return {
-		from( s->city() ).trimmed(),
-		from( s->stateOrProvince() ).trimmed(),
-		from( s->postalCode() ).trimmed(),
-		from( s->countryName() ).trimmed()};
+	return d->locations;
 }
 
 QByteArray DigiDocSignature::messageImprint() const
 {
-	std::vector<unsigned char> d = s->messageImprint();
-	return {(const char *)d.data(), int(d.size())};
+	return d->messageImprint;
 }
 
 QSslCertificate DigiDocSignature::ocspCert() const
 {
-	return toCertificate(s->OCSPCertificate());
+	return d->ocspCert;
 }
 
 QDateTime DigiDocSignature::ocspTime() const
 {
-	return toTime(s->OCSPProducedAt());
+	return d->ocspTime;
 }
 
 const DigiDoc* DigiDocSignature::parent() const { return m_parent; }
@@ -145,12 +366,12 @@ void DigiDocSignature::parseException( DigiDocSignature::SignatureStatus &result
 
 QString DigiDocSignature::policy() const
 {
-	return from(s->policy());
+	return d->policy;
 }
 
 QString DigiDocSignature::profile() const
 {
-	return from(s->profile());
+	return d->profile;
 }
 
 QString DigiDocSignature::role() const
@@ -162,10 +383,7 @@ QString DigiDocSignature::role() const
 
 QStringList DigiDocSignature::roles() const
 {
-	QStringList list;
-	for(const std::string &role: s->signerRoles())
-		list << from( role ).trimmed();
-	return list;
+	return d->roles;
 }
 
 void DigiDocSignature::setLastError( const Exception &e ) const
@@ -181,24 +399,24 @@ void DigiDocSignature::setLastError( const Exception &e ) const
 }
 
 QString DigiDocSignature::signatureMethod() const
-{ return from( s->signatureMethod() ); }
+{ return d->signatureMethod; }
 
 QString DigiDocSignature::signedBy() const
 {
-	return from(s->signedBy());
+	return d->signedBy;
 }
 
 QString DigiDocSignature::spuri() const
 {
-	return from(s->SPUri());
+	return d->spuri;
 }
 
-QSslCertificate DigiDocSignature::toCertificate(const std::vector<unsigned char> &der) const
+QSslCertificate DigiDocSignature::toCertificate(const std::vector<unsigned char> &der)
 {
 	return QSslCertificate(QByteArray::fromRawData((const char *)der.data(), int(der.size())), QSsl::Der);
 }
 
-QDateTime DigiDocSignature::toTime(const std::string &time) const
+QDateTime DigiDocSignature::toTime(const std::string &time)
 {
 	QDateTime date;
 	if(time.empty())
@@ -210,32 +428,54 @@ QDateTime DigiDocSignature::toTime(const std::string &time) const
 
 QDateTime DigiDocSignature::trustedTime() const
 {
-	return toTime(s->trustedSigningTime());
+	return d->trustedTime;
 }
 
 QSslCertificate DigiDocSignature::tsCert() const
 {
-	return toCertificate(s->TimeStampCertificate());
+	return d->tsCert;
 }
 
 QDateTime DigiDocSignature::tsTime() const
 {
-	return toTime(s->TimeStampTime());
+	return d->tsTime;
 }
 
 QSslCertificate DigiDocSignature::tsaCert() const
 {
-	return toCertificate(s->ArchiveTimeStampCertificate());
+	return d->tsaCert;
 }
 
 QDateTime DigiDocSignature::tsaTime() const
 {
-	return toTime(s->ArchiveTimeStampTime());
+	return d->tsaTime;
 }
 
 DigiDocSignature::SignatureStatus DigiDocSignature::validate() const
 {
+	return validate(cacheKey());
+}
+
+DigiDocSignature::SignatureStatus DigiDocSignature::validate(QString key) const
+{
+	auto fromCache = [&](SignatureStatus &status) {
+		ValidationCache::Result cached;
+		if(key.isEmpty() || !ValidationCache::instance().find(key, cached))
+			return false;
+		m_warning = cached.warning;
+		m_lastError = cached.lastError;
+		status = cached.status;
+		return true;
+	};
 	DigiDocSignature::SignatureStatus result = Valid;
+	if(fromCache(result))
+		return result;
+	// The same signature may have been validated while waiting for the lock
+	QMutexLocker locker(&validationLock);
+	if(fromCache(result))
+		return result;
+
+	bool checkPOLv1 = false;
 	m_warning = 0;
 	try
 	{
@@ -245,9 +485,17 @@ DigiDocSignature::SignatureStatus DigiDocSignature::validate() const
 	{
 		parseException( result, e );
 		setLastError( e );
+		if(hasCode(e, {Exception::NetworkError, Exception::HostNotFound, Exception::InvalidUrl}))
+			key.clear();
+		// POLv1 only relaxes the signer certificate qualification requirements,
+		// missing OCSP data makes it fail the same way
+		checkPOLv1 = result == Unknown &&
+			!hasCode(e, {Exception::OCSPResponderMissing, Exception::OCSPCertMissing});
 	}
-	if(result == Unknown && validate(digidoc::Signature::POLv1) == Valid)
-		return NonQSCD;
+	if(checkPOLv1 && validate(digidoc::Signature::POLv1) == Valid)
+		result = NonQSCD;
+	if(!key.isEmpty())
+		ValidationCache::instance().insert(key, {result, m_warning, m_lastError});
 	return result;
 }
 
@@ -412,6 +660,7 @@ DigiDoc::~DigiDoc() { clear(); }
 
 bool DigiDoc::addFile(const QString &file, const QString &mime)
 {
+	cancelValidation();
 	if(!checkDoc(!b->signatures().empty(), tr("Cannot add files to signed container")))
 		return false;
 	try {
@@ -423,6 +672,30 @@ bool DigiDoc::addFile(const QString &file, const QString &mime)
 	return false;
 }
 
+struct DigiDoc::Validation
+{
+	std::atomic<bool> cancelled{false};
+	QSemaphore finished;
+};
+
+void DigiDoc::cancelValidation(bool wait)
+{
+	if(!validation)
+		return;
+	validation->cancelled = true;
+	// Validation stops after the current signature, which may wait for network
+	if(wait)
+		waitFor([state = validation] { state->finished.acquire(); });
+	validation.reset();
+}
+
+void DigiDoc::cancelValidations()
+{
+	validationsCancelled = true;
+	validationPool()->waitForDone();
+	ValidationCache::instance().save();
+}
+
 bool DigiDoc::checkDoc( bool status, const QString &msg ) const
 {
 	if( isNull() )
@@ -434,9 +707,13 @@ bool DigiDoc::checkDoc( bool status, const QString &msg ) const
 
 void DigiDoc::clear()
 {
+	cancelValidation(false);
 	b.reset();
 	parentContainer.reset();
 	m_fileName.clear();
+	m_fileKey.clear();
+	m_signatures.clear();
+	m_timestamps.clear();
 	for(const QString &file: m_tempFiles)
 		{
 #if defined(Q_OS_WIN)
@@ -516,7 +793,10 @@ bool DigiDoc::open( const QString &file )
 
 	try {
 		WaitDialogHolder waitDialog(parent, tr("Opening"), false);
-		waitFor([&] { b = Container::openPtr(to(file)); });
+		waitFor([&] {
+			b = Container::openPtr(to(file));
+		});
+		m_fileKey = fileKey(file);
 		if(b && b->mediaType() == "application/vnd.etsi.asic-s+zip" && b->dataFiles().size() == 1)
 		{
 			const DataFile *f = b->dataFiles().at(0);
@@ -535,6 +815,7 @@ bool DigiDoc::open( const QString &file )
 				}
 			}
 		}
+		waitFor([this] { updateSignatures(); });
 		m_fileName = file;
 		qApp->addRecent( file );
 		containerState = signatures().isEmpty() ? ContainerState::UnsignedSavedContainer : ContainerState::SignedContainer;
@@ -586,10 +867,12 @@ void DigiDoc::parseException(const Exception &e, QStringList &causes, Exception:
 
 void DigiDoc::removeSignature( unsigned int num )
 {
+	cancelValidation();
 	if( !checkDoc( num >= b->signatures().size(), tr("Missing signature") ) )
 		return;
 	try { 
 		b->removeSignature( num );
+		updateSignatures();
 		modified = true;
 	}
 	catch( const Exception &e ) { setLastError( tr("Failed remove signature from container"), e ); }
@@ -602,6 +885,7 @@ bool DigiDoc::save( const QString &filename )
 	if(!saveAs(m_fileName))
 		return false;
 	qApp->addRecent(m_fileName);
+	m_fileKey = fileKey(m_fileName);
 	modified = false;
 	containerState = signatures().isEmpty() ? ContainerState::UnsignedSavedContainer : ContainerState::SignedContainer;
 	return true;
@@ -609,6 +893,7 @@ bool DigiDoc::save( const QString &filename )
 
 bool DigiDoc::saveAs(const QString &filename)
 {
+	cancelValidation();
 	try
 	{
 		waitFor([&]{
@@ -668,6 +953,7 @@ void DigiDoc::setLastError( const QString &msg, const Exception &e )
 bool DigiDoc::sign(const QString &city, const QString &state, const QString &zip,
 	const QString &country, const QString &role, Signer *signer)
 {
+	cancelValidation();
 	if(!checkDoc(b->dataFiles().empty(), tr("Cannot add signature to empty container")))
 		return false;
 
@@ -681,6 +967,7 @@ bool DigiDoc::sign(const QString &city, const QString &state, const QString &zip
 		signer->setProfile("time-stamp");
 		qApp->waitForTSL( fileName() );
 		b->sign(signer);
+		updateSignatures();
 		modified = true;
 		return true;
 	}
@@ -708,31 +995,67 @@ bool DigiDoc::sign(const QString &city, const QString &state, const QString &zip
 
 QList<DigiDocSignature> DigiDoc::signatures() const
 {
-	QList<DigiDocSignature> list;
+	return m_signatures;
+}
+
+ContainerState DigiDoc::state()
+{
+	return containerState;
+}
+
+QList<DigiDocSignature> DigiDoc::timestamps() const
+{
+	return m_timestamps;
+}
+
+void DigiDoc::updateSignatures()
+{
+	m_signatures.clear();
+	m_timestamps.clear();
 	if( isNull() )
-		return list;
+		return;
 	bool isTimeStamped = false;
 	if(parentContainer &&
 		parentContainer->dataFiles().size() == 1 &&
 		parentContainer->signatures().size() == 1 &&
 		from(parentContainer->dataFiles()[0]->fileName()).endsWith(QStringLiteral(".ddoc"), Qt::CaseInsensitive))
 		isTimeStamped = parentContainer->signatures()[0]->trustedSigningTime().compare("2018-07-01T00:00:00Z") < 0;
-	for(const Signature *signature: b->signatures())
-		list << DigiDocSignature(signature, this, isTimeStamped);
-	return list;
-}
-
-ContainerState DigiDoc::state()
-{
-	return containerState;
+	std::vector<Signature*> list = b->signatures();
+	size_t count = list.size();
+	if(parentContainer)
+	{
+		std::vector<Signature*> timestamps = parentContainer->signatures();
+		list.insert(list.cend(), timestamps.cbegin(), timestamps.cend());
+	}
+	// Signature values are read once, libdigidocpp objects of the container are used from one thread
+	for(size_t i = 0; i < list.size(); ++i)
+		(i < count ? m_signatures : m_timestamps) << DigiDocSignature(list[i], this, i < count && isTimeStamped);
 }
 
-QList<DigiDocSignature> DigiDoc::timestamps() const
+void DigiDoc::validate(const QList<DigiDocSignature> &signatures, QObject *receiver,
+	const std::function<void(int index, DigiDocSignature::SignatureStatus status)> &result)
 {
-	QList<DigiDocSignature> list;
-	if(!parentContainer)
-		return list;
-	for(const Signature *signature: parentContainer->signatures())
-		list << DigiDocSignature(signature, this);
-	return list;
+	cancelValidation();
+	// Cache keys read the state of this object, the thread uses only the signatures and keeps containers alive
+	QStringList keys;
+	for(const DigiDocSignature &signature: signatures)
+		keys << signature.cacheKey();
+	// TSL may be updated while the application runs, results of older TSLs are dropped
+	ValidationCache::instance().setTSLVersion(tslVersion());
+	auto state = std::make_shared<Validation>();
+	validation = state;
+	QPointer<QObject> guard(receiver);
+	// The pool runs one task at a time and is waited for on exit, results are delivered through the event loop
+	validationPool()->start(new ValidationTask([signatures, keys, container = b, parent = parentContainer, state, guard, result] {
+		for(int i = 0; i < signatures.size() && !state->cancelled && !validationsCancelled; ++i)
+		{
+			DigiDocSignature::SignatureStatus status = signatures.at(i).validate(keys.at(i));
+			QMetaObject::invokeMethod(QCoreApplication::instance(), [state, guard, result, i, status] {
+				if(!state->cancelled && guard)
+					result(i, status);
+			}, Qt::QueuedConnection);
+		}
+		ValidationCache::instance().save();
+		state->finished.release();
+	}));
 }
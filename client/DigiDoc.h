@@ -24,6 +24,7 @@
 #include <digidocpp/Container.h>
 #include <digidocpp/Exception.h>
 
+#include <functional>
 #include <memory>
 
 class DigiDoc;
@@ -70,17 +71,23 @@ public:
 	QDateTime	tsTime() const;
 	QSslCertificate tsaCert() const;
 	QDateTime	tsaTime() const;
+	// Waits for background validation of the container to finish the signature it is validating
 	SignatureStatus validate() const;
 	int warning() const;
 
 private:
+	QString cacheKey() const;
 	void setLastError( const digidoc::Exception &e ) const;
 	void parseException( SignatureStatus &result, const digidoc::Exception &e ) const;
 	SignatureStatus validate(const std::string &policy) const;
-	QSslCertificate toCertificate(const std::vector<unsigned char> &der) const;
-	QDateTime toTime(const std::string &time) const;
+	SignatureStatus validate(QString cacheKey) const;
+	static QSslCertificate toCertificate(const std::vector<unsigned char> &der);
+	static QDateTime toTime(const std::string &time);
 
+	// Values read from digidoc::Signature on construction, shared between copies
+	struct Data;
 	const digidoc::Signature *s;
+	std::shared_ptr<const Data> d;
 	mutable QString m_lastError;
 	const DigiDoc *m_parent;
 	mutable unsigned int m_warning = 0;
@@ -145,22 +152,40 @@ public:
 	QList<DigiDocSignature> signatures() const;
 	ria::qdigidoc4::ContainerState state();
 	QList<DigiDocSignature> timestamps() const;
-
+	// Validates signatures one by one on a background thread,
+	// result is called on GUI thread for each signature while receiver exists
+	void validate(const QList<DigiDocSignature> &signatures, QObject *receiver,
+		const std::function<void(int index, DigiDocSignature::SignatureStatus status)> &result);
+
+	// Stops background validation of all documents and saves the validation cache,
+	// called on exit before digidoc::terminate()
+	static void cancelValidations();
 	static void parseException( const digidoc::Exception &e, QStringList &causes,
 		digidoc::Exception::ExceptionCode &code);
 
 private:
+	struct Validation;
+
+	// Waits for the signature being validated when the container is going to be used,
+	// otherwise it finishes in the validation pool
+	void cancelValidation(bool wait = true);
 	bool checkDoc( bool status = false, const QString &msg = QString() ) const;
 	void setLastError( const QString &msg, const digidoc::Exception &e );
+	void updateSignatures();
 
-	std::unique_ptr<digidoc::Container> b;
-	std::unique_ptr<digidoc::Container> parentContainer;
+	// Shared with the validation task, which may outlive the open document
+	std::shared_ptr<digidoc::Container> b;
+	std::shared_ptr<digidoc::Container> parentContainer;
 	std::unique_ptr<DocumentModel>		m_documentModel;
 
 	ria::qdigidoc4::ContainerState containerState;
 	bool			modified = false;
 	QString			m_fileName;
+	QByteArray		m_fileKey;
 	QStringList		m_tempFiles;
+	QList<DigiDocSignature> m_signatures;
+	QList<DigiDocSignature> m_timestamps;
+	std::shared_ptr<Validation> validation;
 
 	friend class DigiDocSignature;
 	friend class SDocumentModel;
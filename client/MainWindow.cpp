@@ -83,6 +83,7 @@ MainWindow::MainWindow( QWidget *parent )
 	ui->signIntroButton->setFocus();
 	ui->cryptoIntroLabel->setFont( regular20 );
 	ui->cryptoIntroButton->setFont( condensed14 );
+	ui->cryptoDecryptButton->setFont( condensed14 );
 	ui->noCardInfo->setFont(condensed14);
 	ui->noReaderInfoText->setFont(regular20);
 	ui->noReaderInfoText->setProperty("currenttext", ui->noReaderInfoText->text());
@@ -154,6 +155,12 @@ MainWindow::MainWindow( QWidget *parent )
 
 	connect(ui->signIntroButton, &QPushButton::clicked, this, [this] { openContainer(true); });
 	connect(ui->cryptoIntroButton, &QPushButton::clicked, this, [this] { openContainer(false); });
+	connect(ui->cryptoDecryptButton, &QPushButton::clicked, this, [this] {
+		QStringList files = FileDialog::getOpenFileNames(this, tr("Select documents"), {},
+			QFileDialog::tr("All Files (*)") + QStringLiteral(";;") + tr("Documents (%1)").arg(QLatin1String("*.cdoc")));
+		if(!files.isEmpty())
+			decryptFiles(files);
+	});
 	connect(ui->signContainerPage, &ContainerPage::action, this, &MainWindow::onSignAction);
 	connect(ui->signContainerPage, &ContainerPage::addFiles, this, [this](const QStringList &files) { openFiles(files, true); } );
 	connect(ui->signContainerPage, &ContainerPage::fileRemoved, this, &MainWindow::removeSignatureFile);
@@ -297,8 +304,91 @@ bool MainWindow::decrypt()
 		return false;
 
 	WaitDialogHolder waitDialog(this, tr("Decrypting"));
+	waitDialog.onCancel([this] { cryptoDoc->cancel(); });
+	QMetaObject::Connection progress = connect(cryptoDoc, &CryptoDoc::progress, this, [&waitDialog](qint64 done, qint64 total) {
+		waitDialog.setText(tr("Decrypting %1%").arg(total > 0 ? done * 100 / total : 0));
+	});
+	bool result = cryptoDoc->decrypt();
+	disconnect(progress);
+	return result;
+}
+
+void MainWindow::decryptFiles(const QStringList &files)
+{
+	QString dir = FileDialog::getExistingDirectory(this, tr("Select folder where decrypted files will be stored"));
+	if(dir.isEmpty())
+		return;
+
+	// Every document that is not stored is listed with the reason
+	QStringList errors;
+	auto addError = [&errors](const QString &file, const QString &error) {
+		errors << QStringLiteral("%1: %2").arg(FileDialog::normalized(QFileInfo(file).fileName()), error);
+	};
+	QList<CryptoDoc*> docs;
+	for(const QString &file: files)
+	{
+		CryptoDoc *doc = new CryptoDoc(this);
+		if(doc->open(file))
+			docs << doc;
+		else
+		{
+			addError(file, tr("Failed to open document"));
+			delete doc;
+		}
+	}
+	{
+		WaitDialogHolder waitDialog(this, tr("Decrypting"));
+		waitDialog.onCancel([&docs] {
+			for(CryptoDoc *doc: docs)
+				doc->cancel();
+		});
+		CryptoDoc::decrypt(docs);
+	}
 
-	return cryptoDoc->decrypt();
+	// Files of each document are stored to a folder named after the document, existing files are kept
+	int decrypted = 0;
+	for(CryptoDoc *doc: qAsConst(docs))
+	{
+		if(doc->state() != UnencryptedContainer)
+		{
+			addError(doc->fileName(), doc->lastError().isEmpty() ? tr("Document was not decrypted") : doc->lastError());
+			continue;
+		}
+		QDir target(dir);
+		const QString name = FileDialog::safeName(QFileInfo(doc->fileName()).completeBaseName());
+		if(!target.mkpath(name) || !target.cd(name))
+		{
+			addError(doc->fileName(), tr("Failed to create folder %1").arg(QDir::toNativeSeparators(target.filePath(name))));
+			continue;
+		}
+		bool saved = true;
+		DocumentModel *model = doc->documentModel();
+		for(int i = 0; i < model->rowCount(); ++i)
+		{
+			QString dest = target.filePath(FileDialog::safePath(model->data(i)));
+			QString error;
+			if(QFile::exists(dest))
+				error = tr("File %1 already exists").arg(QDir::toNativeSeparators(dest));
+			else if(model->save(i, dest).isEmpty())
+				error = tr("Failed to save file %1").arg(QDir::toNativeSeparators(dest));
+			if(error.isEmpty())
+				continue;
+			addError(doc->fileName(), error);
+			saved = false;
+		}
+		if(saved)
+			++decrypted;
+	}
+	qDeleteAll(docs);
+
+	const QString result = tr("Decrypted %1 of %2 documents").arg(decrypted).arg(files.size());
+	if(!errors.isEmpty())
+	{
+		qApp->showWarning(result, errors.join('\n'));
+		return;
+	}
+	FadeInNotification* notification = new FadeInNotification( this, WHITE, MANTIS, 110 );
+	notification->start( result, 750, 3000, 1200 );
 }
 
 void MainWindow::dragEnterEvent(QDragEnterEvent *event)
@@ -363,8 +453,13 @@ bool MainWindow::encrypt()
 	}
 
 	WaitDialogHolder waitDialog(this, tr("Encrypting"));
-
-	return cryptoDoc->encrypt();
+	waitDialog.onCancel([this] { cryptoDoc->cancel(); });
+	QMetaObject::Connection progress = connect(cryptoDoc, &CryptoDoc::progress, this, [&waitDialog](qint64 done, qint64 total) {
+		waitDialog.setText(tr("Encrypting %1%").arg(total > 0 ? done * 100 / total : 0));
+	});
+	bool result = cryptoDoc->encrypt();
+	disconnect(progress);
+	return result;
 }
 
 void MainWindow::mouseReleaseEvent(QMouseEvent *event)
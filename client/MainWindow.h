@@ -79,6 +79,7 @@ private:
 	void convertToCDoc();
 	ria::qdigidoc4::ContainerState currentState();
 	bool decrypt();
+	void decryptFiles(const QStringList &files);
 	QStringList dropEventFiles(QDropEvent *event) const;
 	bool encrypt();
 	void loadPicture();
@@ -105,6 +105,16 @@ std::vector<CK_OBJECT_HANDLE> QPKCS11::Private::findObject(CK_SESSION_HANDLE ses
 	return result;
 }
 
+CK_OBJECT_HANDLE QPKCS11::Private::privateKey() const
+{
+	if(key != CK_INVALID_HANDLE)
+		return key;
+	std::vector<CK_OBJECT_HANDLE> list = findObject(session, CKO_PRIVATE_KEY, id);
+	if(list.size() == 1)
+		key = list[0];
+	return key;
+}
+
 void QPKCS11::Private::run()
 {
 	result = f->C_Login(session, CKU_USER, nullptr, 0);
@@ -126,8 +136,8 @@ QPKCS11::~QPKCS11()
 
 QByteArray QPKCS11::derive(const QByteArray &publicKey) const
 {
-	std::vector<CK_OBJECT_HANDLE> key = d->findObject(d->session, CKO_PRIVATE_KEY, d->id);
-	if(key.size() != 1)
+	CK_OBJECT_HANDLE key = d->privateKey();
+	if(key == CK_INVALID_HANDLE)
 		return {};
 
 	CK_ECDH1_DERIVE_PARAMS ecdh_parms = { CKD_NULL, 0, nullptr, CK_ULONG(publicKey.size()), CK_BYTE_PTR(publicKey.data()) };
@@ -141,7 +151,7 @@ QByteArray QPKCS11::derive(const QByteArray &publicKey) const
 		{CKA_KEY_TYPE, &newkey_type, sizeof(newkey_type)},
 	};
 	CK_OBJECT_HANDLE newkey = CK_INVALID_HANDLE;
-	if(d->f->C_DeriveKey(d->session, &mech, key[0], newkey_template.data(), CK_ULONG(newkey_template.size()), &newkey) != CKR_OK)
+	if(d->f->C_DeriveKey(d->session, &mech, key, newkey_template.data(), CK_ULONG(newkey_template.size()), &newkey) != CKR_OK)
 		return {};
 
 	return d->attribute(d->session, newkey, CKA_VALUE);
@@ -156,12 +166,12 @@ QByteArray QPKCS11::deriveConcatKDF(const QByteArray &publicKey, const QString &
 QByteArray QPKCS11::decrypt( const QByteArray &data ) const
 {
 	QByteArray result;
-	std::vector<CK_OBJECT_HANDLE> key = d->findObject(d->session, CKO_PRIVATE_KEY, d->id);
-	if(key.size() != 1)
+	CK_OBJECT_HANDLE key = d->privateKey();
+	if(key == CK_INVALID_HANDLE)
 		return result;
 
 	CK_MECHANISM mech = { CKM_RSA_PKCS, nullptr, 0 };
-	if(d->f->C_DecryptInit(d->session, &mech, key[0]) != CKR_OK)
+	if(d->f->C_DecryptInit(d->session, &mech, key) != CKR_OK)
 		return result;
 
 	CK_ULONG size = 0;
@@ -283,6 +293,7 @@ QPKCS11::PinStatus QPKCS11::login(const TokenData &t)
 void QPKCS11::logout()
 {
 	d->id.clear();
+	d->key = CK_INVALID_HANDLE;
 	if( d->f && d->session )
 	{
 		d->f->C_Logout( d->session );
@@ -388,16 +399,16 @@ bool QPKCS11::reload()
 QByteArray QPKCS11::sign( int type, const QByteArray &digest ) const
 {
 	QByteArray sig;
-	std::vector<CK_OBJECT_HANDLE> key = d->findObject(d->session, CKO_PRIVATE_KEY, d->id);
-	if(key.size() != 1)
+	CK_OBJECT_HANDLE key = d->privateKey();
+	if(key == CK_INVALID_HANDLE)
 		return sig;
 
 	CK_KEY_TYPE keyType = CKK_RSA;
 	CK_ATTRIBUTE attribute = { CKA_KEY_TYPE, &keyType, sizeof(keyType) };
-	d->f->C_GetAttributeValue(d->session, key[0], &attribute, 1);
+	d->f->C_GetAttributeValue(d->session, key, &attribute, 1);
 
 	CK_MECHANISM mech = { keyType == CKK_ECDSA ? CKM_ECDSA : CKM_RSA_PKCS, nullptr, 0 };
-	if(d->f->C_SignInit(d->session, &mech, key[0]) != CKR_OK)
+	if(d->f->C_SignInit(d->session, &mech, key) != CKR_OK)
 		return sig;
 
 	QByteArray data;
@@ -34,12 +34,15 @@ class QPKCS11::Private: public QThread
 public:
 	QByteArray attribute( CK_SESSION_HANDLE session, CK_OBJECT_HANDLE obj, CK_ATTRIBUTE_TYPE type ) const;
 	std::vector<CK_OBJECT_HANDLE> findObject(CK_SESSION_HANDLE session, CK_OBJECT_CLASS cls, const QByteArray &id = {}) const;
+	CK_OBJECT_HANDLE privateKey() const;
 
 	QLibrary		lib;
 	CK_FUNCTION_LIST_PTR f = nullptr;
 	bool			isFinDriver = false;
 	CK_SESSION_HANDLE session = 0;
 	QByteArray		id;
+	// Private key handle of logged in session, looked up once for consecutive operations
+	mutable CK_OBJECT_HANDLE key = CK_INVALID_HANDLE;
 
 	void run() override;
 	CK_RV result = CKR_OK;
@@ -51,6 +51,7 @@ public:
 	QSmartCard		*smartcard = nullptr;
 	TokenData		auth, sign;
 	QList<TokenData> cache;
+	bool			decryptSession = false;
 
 	static QByteArray signData(int type, const QByteArray &digest, Private *d);
 	static int rsa_sign(int type, const unsigned char *m, unsigned int m_len,
@@ -186,9 +187,11 @@ X509Cert QSigner::cert() const
 	return X509Cert((const unsigned char*)der.constData(), size_t(der.size()), X509Cert::Der);
 }
 
-QSigner::ErrorCode QSigner::decrypt(const QByteArray &in, QByteArray &out, const QString &digest, int keySize,
-	const QByteArray &algorithmID, const QByteArray &partyUInfo, const QByteArray &partyVInfo)
+QSigner::ErrorCode QSigner::beginDecrypt()
 {
+	if(d->decryptSession)
+		return DecryptOK;
+
 	if(!QCardLock::instance().exclusiveTryLock())
 	{
 		Q_EMIT error( tr("Signing/decrypting is already in progress another window.") );
@@ -226,15 +229,28 @@ QSigner::ErrorCode QSigner::decrypt(const QByteArray &in, QByteArray &out, const
 			return DecryptFailed;
 		}
 	} while(status != QCryptoBackend::PinOK);
+	d->decryptSession = true;
+	return DecryptOK;
+}
+
+QSigner::ErrorCode QSigner::decrypt(const QByteArray &in, QByteArray &out, const QString &digest, int keySize,
+	const QByteArray &algorithmID, const QByteArray &partyUInfo, const QByteArray &partyVInfo)
+{
+	bool session = d->decryptSession;
+	if(!session)
+	{
+		ErrorCode status = beginDecrypt();
+		if(status != DecryptOK)
+			return status;
+	}
 	waitFor([&]{
 		if(d->auth.cert().publicKey().algorithm() == QSsl::Rsa)
 			out = d->backend->decrypt(in);
 		else
 			out = d->backend->deriveConcatKDF(in, digest, keySize, algorithmID, partyUInfo, partyVInfo);
 	});
-	QCardLock::instance().exclusiveUnlock();
-	d->backend->logout();
-	d->smartcard->reload(); // QSmartCard should also know that PIN1 is blocked.
+	if(!session)
+		endDecrypt();
 	if(d->backend->lastError() == QCryptoBackend::PinCanceled)
 		return PinCanceled;
 
@@ -243,6 +259,16 @@ QSigner::ErrorCode QSigner::decrypt(const QByteArray &in, QByteArray &out, const
 	return !out.isEmpty() ? DecryptOK : DecryptFailed;
 }
 
+void QSigner::endDecrypt()
+{
+	if(!d->decryptSession)
+		return;
+	d->decryptSession = false;
+	QCardLock::instance().exclusiveUnlock();
+	d->backend->logout();
+	d->smartcard->reload(); // QSmartCard should also know that PIN1 is blocked.
+}
+
 QSslKey QSigner::key() const
 {
 	if(!QCardLock::instance().exclusiveTryLock())
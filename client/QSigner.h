@@ -49,11 +49,14 @@ public:
 	~QSigner() final;
 
 	ApiType apiType() const;
+	// Keeps token logged in for consecutive decrypt() calls until endDecrypt()
+	ErrorCode beginDecrypt();
 	QSet<QString> cards() const;
 	QList<TokenData> cache() const;
 	digidoc::X509Cert cert() const final;
 	ErrorCode decrypt(const QByteArray &in, QByteArray &out, const QString &digest, int keySize,
 		const QByteArray &algorithmID, const QByteArray &partyUInfo, const QByteArray &partyVInfo);
+	void endDecrypt();
 	QSslKey key() const;
 	void logout();
 	void selectCard(const TokenData &token);
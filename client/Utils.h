@@ -20,8 +20,16 @@
 #pragma once
 
 #include <QEventLoop>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QThreadPool>
+#include <algorithm>
+#include <atomic>
 #include <exception>
+#include <functional>
+#include <memory>
 #include <thread>
+#include <vector>
 
 namespace {
 	template <typename F>
@@ -41,6 +49,46 @@ namespace {
 			std::rethrow_exception(exception);
 	}
 
+	class ParallelTask final: public QRunnable {
+	public:
+		explicit ParallelTask(std::function<void()> function) : function(std::move(function)) { setAutoDelete(false); }
+		void run() final { function(); }
+	private:
+		std::function<void()> function;
+	};
+
+	// Calls function(i) for i in [0, count) on all CPU cores or given number of threads, calling thread takes part in the work.
+	// Helper threads are taken from the global thread pool, so nested calls do not multiply the number of threads:
+	// when the pool is busy the calling thread does the work itself and queued helpers are withdrawn.
+	template <typename F>
+	inline void parallelFor(int count, F&& function, int threads = 0) {
+		std::atomic<int> next{0};
+		auto worker = [&] {
+			for(int i = next++; i < count; i = next++)
+				function(i);
+		};
+		QThreadPool *pool = QThreadPool::globalInstance();
+		if(threads <= 0)
+			threads = std::max(1, pool->maxThreadCount());
+		threads = std::min(threads, count);
+		QSemaphore done;
+		std::vector<std::unique_ptr<ParallelTask>> tasks;
+		for(int i = 1; i < threads; ++i) {
+			tasks.emplace_back(new ParallelTask([&] {
+				worker();
+				done.release();
+			}));
+			pool->start(tasks.back().get());
+		}
+		worker();
+		int started = 0;
+		for(const std::unique_ptr<ParallelTask> &task: tasks) {
+			if(!pool->tryTake(task.get()))
+				++started;
+		}
+		done.acquire(started);
+	}
+
 	inline QString escapeUnicode(const QString &str) {
 		QString escaped;
 		escaped.reserve(6 * str.size());
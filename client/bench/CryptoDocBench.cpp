@@ -0,0 +1,417 @@
+/*
+ * QDigiDocCrypto
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include "CryptoDocBench.h"
+
+#include "Base64.h"
+#include "CryptoDoc.h"
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QDir>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QJsonArray>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QJsonObject>
+#include <QtCore/QTemporaryDir>
+
+#include <openssl/aes.h>
+#include <openssl/ec.h>
+#include <openssl/rand.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+
+#include <algorithm>
+#include <iostream>
+
+#if defined(Q_OS_WIN)
+#include <qt_windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#define SCOPE(TYPE, DATA) std::unique_ptr<TYPE,decltype(&TYPE##_free)>(DATA, TYPE##_free)
+
+using puchar = uchar *;
+using pcuchar = const uchar *;
+
+/**
+ * Benchmark for CDOC encryption and decryption paths using software RSA and EC keys.
+ * Documents are handled through the headless CryptoDoc API, so no token or user interface is needed.
+ */
+class CryptoDocBench
+{
+public:
+	CryptoDocBench()
+		: rsa(generate(EVP_PKEY_RSA))
+		, ec(generate(EVP_PKEY_EC))
+	{}
+
+	bool isValid() const { return rsa && ec; }
+
+	QJsonObject run(qint64 size, int recipients);
+	QJsonObject runConcatKDF();
+
+private:
+	using PKEY = std::unique_ptr<EVP_PKEY,decltype(&EVP_PKEY_free)>;
+
+	static PKEY generate(int type);
+	static QSslCertificate certificate(EVP_PKEY *pkey, int serial);
+	static bool createFile(const QString &path, qint64 size);
+	static QByteArray AES_unwrap(const QByteArray &key, const QByteArray &data);
+	static QByteArray unwrapKey(EVP_PKEY *pkey, const CKey &key);
+	static void resetPeakRss();
+	static qint64 peakRss();
+
+	template<typename F>
+	static QJsonObject measure(qint64 bytes, F &&function);
+
+	QList<CKey> keys(int count);
+
+	PKEY rsa, ec;
+	QList<CKey> pool;
+	QTemporaryDir dir;
+};
+
+CryptoDocBench::PKEY CryptoDocBench::generate(int type)
+{
+	EVP_PKEY *pkey = nullptr;
+	auto ctx = SCOPE(EVP_PKEY_CTX, EVP_PKEY_CTX_new_id(type, nullptr));
+	if(!ctx || EVP_PKEY_keygen_init(ctx.get()) <= 0 ||
+		(type == EVP_PKEY_RSA && EVP_PKEY_CTX_set_rsa_keygen_bits(ctx.get(), 2048) <= 0) ||
+		(type == EVP_PKEY_EC && EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx.get(), NID_secp384r1) <= 0) ||
+		EVP_PKEY_keygen(ctx.get(), &pkey) <= 0)
+		return PKEY(nullptr, EVP_PKEY_free);
+	return PKEY(pkey, EVP_PKEY_free);
+}
+
+QSslCertificate CryptoDocBench::certificate(EVP_PKEY *pkey, int serial)
+{
+	auto x509 = SCOPE(X509, X509_new());
+	QByteArray cn = "CryptoDoc benchmark " + QByteArray::number(serial);
+	X509_set_version(x509.get(), 2);
+	ASN1_INTEGER_set(X509_get_serialNumber(x509.get()), serial);
+	X509_gmtime_adj(X509_getm_notBefore(x509.get()), 0);
+	X509_gmtime_adj(X509_getm_notAfter(x509.get()), 24 * 60 * 60);
+	X509_set_pubkey(x509.get(), pkey);
+	X509_NAME *name = X509_get_subject_name(x509.get());
+	X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_UTF8, pcuchar(cn.constData()), -1, -1, 0);
+	X509_set_issuer_name(x509.get(), name);
+	if(X509_sign(x509.get(), pkey, EVP_sha256()) <= 0)
+		return {};
+	QByteArray der(i2d_X509(x509.get(), nullptr), 0);
+	puchar p = puchar(der.data());
+	i2d_X509(x509.get(), &p);
+	return QSslCertificate(der, QSsl::Der);
+}
+
+bool CryptoDocBench::createFile(const QString &path, qint64 size)
+{
+	QFile file(path);
+	if(!file.open(QFile::WriteOnly))
+		return false;
+	QByteArray block(1024 * 1024, Qt::Uninitialized);
+	RAND_bytes(puchar(block.data()), block.size());
+	for(qint64 pos = 0; pos < size; pos += block.size())
+	{
+		qint64 len = qMin<qint64>(block.size(), size - pos);
+		if(file.write(block.constData(), len) != len)
+			return false;
+	}
+	return true;
+}
+
+QByteArray CryptoDocBench::AES_unwrap(const QByteArray &key, const QByteArray &data)
+{
+	AES_KEY aes = {};
+	if(data.size() <= 8 || AES_set_decrypt_key(pcuchar(key.data()), key.length() * 8, &aes) != 0)
+		return {};
+	QByteArray result(data.size() - 8, 0);
+	int size = AES_unwrap_key(&aes, nullptr, puchar(result.data()), pcuchar(data.data()), uint(data.size()));
+	return size > 0 ? result.left(size) : QByteArray();
+}
+
+QList<CKey> CryptoDocBench::keys(int count)
+{
+	// Recipients alternate between RSA and EC keys, first recipient is always RSA
+	while(pool.size() < count)
+		pool << CKey(certificate(pool.size() % 2 ? ec.get() : rsa.get(), pool.size() + 1));
+	return pool.mid(0, count);
+}
+
+QByteArray CryptoDocBench::unwrapKey(EVP_PKEY *pkey, const CKey &key)
+{
+	if(EVP_PKEY_base_id(pkey) == EVP_PKEY_RSA)
+	{
+		auto ctx = SCOPE(EVP_PKEY_CTX, EVP_PKEY_CTX_new(pkey, nullptr));
+		size_t size = 0;
+		if(!ctx || EVP_PKEY_decrypt_init(ctx.get()) <= 0 ||
+			EVP_PKEY_CTX_set_rsa_padding(ctx.get(), RSA_PKCS1_PADDING) <= 0 ||
+			EVP_PKEY_decrypt(ctx.get(), nullptr, &size, pcuchar(key.cipher.constData()), size_t(key.cipher.size())) <= 0)
+			return {};
+		QByteArray result(int(size), 0);
+		if(EVP_PKEY_decrypt(ctx.get(), puchar(result.data()), &size, pcuchar(key.cipher.constData()), size_t(key.cipher.size())) <= 0)
+			return {};
+		result.resize(int(size));
+		return result;
+	}
+
+	// Same steps as the token performs: ECDH with the ephemeral key, ConcatKDF and AES key unwrap
+	auto eckey = SCOPE(EC_KEY, EC_KEY_new_by_curve_name(NID_secp384r1));
+	EC_KEY *peerKey = eckey.get();
+	pcuchar p = pcuchar(key.publicKey.constData());
+	auto peer = SCOPE(EVP_PKEY, EVP_PKEY_new());
+	if(!o2i_ECPublicKey(&peerKey, &p, key.publicKey.size()) || EVP_PKEY_set1_EC_KEY(peer.get(), peerKey) <= 0)
+		return {};
+	auto ctx = SCOPE(EVP_PKEY_CTX, EVP_PKEY_CTX_new(pkey, nullptr));
+	size_t size = 0;
+	if(!ctx || EVP_PKEY_derive_init(ctx.get()) <= 0 ||
+		EVP_PKEY_derive_set_peer(ctx.get(), peer.get()) <= 0 ||
+		EVP_PKEY_derive(ctx.get(), nullptr, &size) <= 0)
+		return {};
+	QByteArray sharedSecret(int(size), 0);
+	if(EVP_PKEY_derive(ctx.get(), puchar(sharedSecret.data()), &size) <= 0)
+		return {};
+	quint32 keySize = 0;
+	if(key.method.endsWith(QLatin1String("#kw-aes128")))
+		keySize = 16;
+	else if(key.method.endsWith(QLatin1String("#kw-aes192")))
+		keySize = 24;
+	else if(key.method.endsWith(QLatin1String("#kw-aes256")))
+		keySize = 32;
+	QByteArray encryptionKey = CryptoDoc::concatKDF(key.concatDigest, keySize,
+		sharedSecret, key.AlgorithmID + key.PartyUInfo + key.PartyVInfo);
+	return AES_unwrap(encryptionKey, key.cipher);
+}
+
+void CryptoDocBench::resetPeakRss()
+{
+#if defined(Q_OS_LINUX)
+	// Resets VmHWM of the process
+	QFile file(QStringLiteral("/proc/self/clear_refs"));
+	if(file.open(QFile::WriteOnly))
+		file.write("5");
+#endif
+}
+
+qint64 CryptoDocBench::peakRss()
+{
+#if defined(Q_OS_WIN)
+	PROCESS_MEMORY_COUNTERS counters{};
+	if(GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return qint64(counters.PeakWorkingSetSize / 1024);
+	return 0;
+#else
+#if defined(Q_OS_LINUX)
+	QFile file(QStringLiteral("/proc/self/status"));
+	if(file.open(QFile::ReadOnly))
+	{
+		for(const QByteArray &line: file.readAll().split('\n'))
+		{
+			if(line.startsWith("VmHWM:"))
+				return line.mid(6).trimmed().split(' ').value(0).toLongLong();
+		}
+	}
+#endif
+	rusage usage{};
+	getrusage(RUSAGE_SELF, &usage);
+#if defined(Q_OS_MAC)
+	return qint64(usage.ru_maxrss / 1024);
+#else
+	return qint64(usage.ru_maxrss);
+#endif
+#endif
+}
+
+template<typename F>
+QJsonObject CryptoDocBench::measure(qint64 bytes, F &&function)
+{
+	resetPeakRss();
+	QElapsedTimer timer;
+	timer.start();
+	bool result = function();
+	double seconds = std::max<double>(double(timer.nsecsElapsed()) / 1e9, 1e-9);
+	QJsonObject obj{
+		{QStringLiteral("ok"), result},
+		{QStringLiteral("ms"), seconds * 1000},
+		{QStringLiteral("peak_rss_kb"), double(peakRss())},
+	};
+	if(bytes > 0)
+		obj[QStringLiteral("mb_per_s")] = double(bytes) / 1048576.0 / seconds;
+	return obj;
+}
+
+QJsonObject CryptoDocBench::run(qint64 size, int recipients)
+{
+	QList<CKey> recipientKeys = keys(recipients);
+	QString plain = dir.filePath(QStringLiteral("plain.bin"));
+	QString cdoc = dir.filePath(QStringLiteral("plain.bin.cdoc"));
+	QJsonObject result{
+		{QStringLiteral("size"), double(size)},
+		{QStringLiteral("recipients"), recipients},
+	};
+	if(!createFile(plain, size))
+	{
+		result[QStringLiteral("error")] = QStringLiteral("Failed to create input file");
+		return result;
+	}
+
+	result[QStringLiteral("encrypt")] = measure(size, [&] {
+		QString error;
+		return CryptoDoc::encryptFile(plain, cdoc, recipientKeys, CryptoDoc::EncryptOptions(), error);
+	});
+	qint64 cdocSize = QFileInfo(cdoc).size();
+	result[QStringLiteral("cdoc_size")] = double(cdocSize);
+
+	// Header with all recipients, payload is skipped
+	result[QStringLiteral("inventory")] = measure(0, [&] {
+		QJsonObject doc = CryptoDoc::inventory(cdoc);
+		return !doc.contains(QStringLiteral("error")) &&
+			doc.value(QStringLiteral("recipients")).toArray().size() == recipients;
+	});
+
+	// Includes parsing the header and RSA unwrap of the transport key
+	QList<CKey> docKeys;
+	QString folder = dir.filePath(QStringLiteral("decrypted"));
+	result[QStringLiteral("decrypt")] = measure(size, [&] {
+		QString error;
+		return CryptoDoc::decryptFile(cdoc, folder, [&](const QList<CKey> &keys) {
+			docKeys = keys;
+			int i = keys.indexOf(recipientKeys.first());
+			return i < 0 ? QByteArray() : unwrapKey(rsa.get(), keys.at(i));
+		}, error) && QFileInfo(QDir(folder).filePath(QStringLiteral("plain.bin"))).size() == size;
+	});
+	QDir(folder).removeRecursively();
+
+	if(recipients > 1)
+	{
+		int i = docKeys.indexOf(recipientKeys.at(1));
+		result[QStringLiteral("unwrap_ec")] = measure(0, [&] {
+			return i >= 0 && !unwrapKey(ec.get(), docKeys.at(i)).isEmpty();
+		});
+	}
+
+	// Base64 decoding of XML text, limited to 64MB of decoded data
+	qint64 base64Size = qMin<qint64>(size, 64 * 1024 * 1024);
+	QByteArray data(int(base64Size), 'A');
+	QString text(int(Base64Encoder::encodedSize(size_t(data.size()))), Qt::Uninitialized);
+	Base64Encoder::encode(data.constData(), size_t(data.size()), reinterpret_cast<ushort*>(text.data()));
+	result[QStringLiteral("base64_decode")] = measure(text.size(), [&] {
+		QByteArray decoded((text.size() * 3) / 4, Qt::Uninitialized);
+		const ushort *in = reinterpret_cast<const ushort*>(text.constData());
+		const char *end = Base64Decoder().decode(in, in + text.size(), decoded.data());
+		decoded.truncate(int(end - decoded.constData()));
+		return decoded == data;
+	});
+
+	QFile::remove(plain);
+	QFile::remove(cdoc);
+	return result;
+}
+
+QJsonObject CryptoDocBench::runConcatKDF()
+{
+	constexpr int rounds = 10000;
+	QByteArray z(48, 0), otherInfo(256, 0);
+	RAND_bytes(puchar(z.data()), z.size());
+	RAND_bytes(puchar(otherInfo.data()), otherInfo.size());
+	QJsonObject result = measure(0, [&] {
+		for(int i = 0; i < rounds; ++i)
+		{
+			if(CryptoDoc::concatKDF(QStringLiteral("http://www.w3.org/2001/04/xmlenc#sha384"), 32, z, otherInfo).size() != 32)
+				return false;
+		}
+		return true;
+	});
+	result[QStringLiteral("rounds")] = rounds;
+	result[QStringLiteral("ops_per_s")] = rounds / (result[QStringLiteral("ms")].toDouble() / 1000);
+	return result;
+}
+
+static qint64 parseSize(QString value)
+{
+	qint64 unit = 1;
+	if(value.endsWith('K', Qt::CaseInsensitive))
+		unit = 1024;
+	else if(value.endsWith('M', Qt::CaseInsensitive))
+		unit = 1024 * 1024;
+	else if(value.endsWith('G', Qt::CaseInsensitive))
+		unit = 1024 * 1024 * 1024;
+	if(unit > 1)
+		value.chop(1);
+	return value.toLongLong() * unit;
+}
+
+int runBenchmark(const QStringList &args)
+{
+	QStringList sizes{QStringLiteral("1K"), QStringLiteral("1M"), QStringLiteral("64M")};
+	QStringList recipients{QStringLiteral("1"), QStringLiteral("10"), QStringLiteral("100")};
+	QString out;
+	for(const QString &arg: args)
+	{
+		if(arg.startsWith(QStringLiteral("-sizes:")))
+			sizes = arg.mid(7).split(',');
+		else if(arg.startsWith(QStringLiteral("-recipients:")))
+			recipients = arg.mid(12).split(',');
+		else if(arg.startsWith(QStringLiteral("-out:")))
+			out = arg.mid(5);
+		else
+		{
+			std::cerr << "Usage: qdigidoc4 -bench [-sizes:1K,1M,64M] [-recipients:1,10,100] [-out:<file>]" << std::endl;
+			return 1;
+		}
+	}
+
+	CryptoDocBench bench;
+	if(!bench.isValid())
+	{
+		std::cerr << "Failed to generate benchmark keys" << std::endl;
+		return 1;
+	}
+
+	bool failed = false;
+	QJsonArray results;
+	for(const QString &size: qAsConst(sizes))
+	{
+		for(const QString &count: qAsConst(recipients))
+		{
+			QJsonObject result = bench.run(parseSize(size), std::max(1, count.toInt()));
+			for(const QJsonValue &value: qAsConst(result))
+				failed |= value.isObject() && !value.toObject().value(QStringLiteral("ok")).toBool();
+			failed |= result.contains(QStringLiteral("error"));
+			results.append(result);
+		}
+	}
+
+	QJsonDocument doc(QJsonObject{
+		{QStringLiteral("version"), QCoreApplication::applicationVersion()},
+		{QStringLiteral("concatKDF"), bench.runConcatKDF()},
+		{QStringLiteral("results"), results},
+	});
+	QFile file;
+	if(out.isEmpty() ? !file.open(stdout, QFile::WriteOnly) : (file.setFileName(out), !file.open(QFile::WriteOnly)))
+	{
+		std::cerr << out.toStdString() << ": " << file.errorString().toStdString() << std::endl;
+		return 1;
+	}
+	file.write(doc.toJson());
+	return failed ? 1 : 0;
+}
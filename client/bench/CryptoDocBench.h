@@ -0,0 +1,29 @@
+/*
+ * QDigiDocCrypto
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#pragma once
+
+#include <QtCore/QStringList>
+
+/**
+ * Times CDOC encryption and decryption with software RSA and EC keys:
+ * qdigidoc4 -bench [-sizes:1K,1M,64M] [-recipients:1,10,100] [-out:<file>]
+ * Results are written as JSON with time, throughput and peak RSS of each step.
+ */
+int runBenchmark(const QStringList &args);
@@ -132,10 +132,10 @@ void AddRecipients::addAllRecipientToRightPane()
 
 	for(AddressItem *value: leftList)
 	{
-		if(!rightList.contains(value->getKey().cert))
+		if(!rightList.contains(value->getKey().cert()))
 		{
 			addRecipientToRightPane(value);
-			history << toHistory(value->getKey().cert);
+			history << toHistory(value->getKey().cert());
 		}
 	}
 	ui->confirm->setDisabled(rightList.isEmpty());
@@ -217,12 +217,12 @@ AddressItem * AddRecipients::addRecipientToLeftPane(const QSslCertificate& cert)
 
 bool AddRecipients::addRecipientToRightPane(const CKey &key, bool update)
 {
-	if (rightList.contains(key.cert))
+	if (rightList.contains(key.cert()))
 		return false;
 
 	if(update)
 	{
-		auto expiryDate = key.cert.expiryDate();
+		auto expiryDate = key.cert().expiryDate();
 		if(expiryDate <= QDateTime::currentDateTime())
 		{
 			WarningDialog dlg(tr("Are you sure that you want use certificate for encrypting, which expired on %1?<br />"
@@ -233,8 +233,8 @@ bool AddRecipients::addRecipientToRightPane(const CKey &key, bool update)
 			if(dlg.exec() != QMessageBox::Yes)
 				return false;
 		}
-		QList<QSslError> errors = QSslCertificate::verify({ key.cert });
-		errors.removeAll(QSslError(QSslError::CertificateExpired, key.cert));
+		QList<QSslError> errors = QSslCertificate::verify({ key.cert() });
+		errors.removeAll(QSslError(QSslError::CertificateExpired, key.cert()));
 		if(!errors.isEmpty())
 		{
 			WarningDialog dlg(tr("Recipient’s certification chain contains certificates that are not trusted. Continue with encryption?"), this);
@@ -246,7 +246,7 @@ bool AddRecipients::addRecipientToRightPane(const CKey &key, bool update)
 	}
 	updated = update;
 
-	rightList.append(key.cert);
+	rightList.append(key.cert());
 
 	AddressItem *rightItem = new AddressItem(key, ui->rightPane);
 	ui->rightPane->addWidget(rightItem);
@@ -254,7 +254,7 @@ bool AddRecipients::addRecipientToRightPane(const CKey &key, bool update)
 
 	connect(rightItem, &AddressItem::remove, this, &AddRecipients::removeRecipientFromRightPane );
 	ui->confirm->setDisabled(rightList.isEmpty());
-	rememberCerts({toHistory(key.cert)});
+	rememberCerts({toHistory(key.cert())});
 	return true;
 }
 
@@ -338,13 +338,13 @@ void AddRecipients::rememberCerts(const QList<HistoryCertData>& selectedCertData
 void AddRecipients::removeRecipientFromRightPane(Item *toRemove)
 {
 	AddressItem *rightItem = static_cast<AddressItem *>(toRemove);
-	auto it = leftList.find(rightItem->getKey().cert);
+	auto it = leftList.find(rightItem->getKey().cert());
 	if(it != leftList.end())
 	{
 		it.value()->disable(false);
 		it.value()->showButton(AddressItem::Add);
 	}
-	rightList.removeAll(rightItem->getKey().cert);
+	rightList.removeAll(rightItem->getKey().cert());
 	updated = true;
 	ui->confirm->setDisabled(rightList.isEmpty());
 }
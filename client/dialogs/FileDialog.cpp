@@ -347,3 +347,15 @@ QString FileDialog::safeName(const QString &file)
 #endif
 	return filename;
 }
+
+QString FileDialog::safePath(const QString &file)
+{
+	QStringList parts = file.split('/');
+	for(QString &part: parts)
+	{
+		if(part.isEmpty() || part == QLatin1String(".") || part == QLatin1String(".."))
+			return safeName(file);
+		part = safeName(part);
+	}
+	return parts.join('/');
+}
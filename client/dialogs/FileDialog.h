@@ -43,6 +43,8 @@ public:
 	static void setFileZone(const QString &path, int zone);
 	static QString normalized(const QString &file);
 	static QString safeName(const QString &file);
+	// Relative path with safe names, absolute paths and parent references are reduced to safeName
+	static QString safePath(const QString &file);
 	static QString tempPath(const QString &file);
 
 	static QString getOpenFileName(QWidget *parent = nullptr, const QString &caption = {},
@@ -47,7 +47,7 @@ KeyDialog::KeyDialog( const CKey &k, QWidget *parent )
 
 	connect(d->close, &QPushButton::clicked, this, &KeyDialog::accept);
 	connect(d->showCert, &QPushButton::clicked, this, [=] {
-		CertificateDetails::showCertificate(SslCertificate(k.cert), this);
+		CertificateDetails::showCertificate(SslCertificate(k.cert()), this);
 	});
 
 	auto addItem = [&](const QString &parameter, const QString &value) {
@@ -67,8 +67,8 @@ KeyDialog::KeyDialog( const CKey &k, QWidget *parent )
 	if(!k.concatDigest.isEmpty())
 		addItem(tr("ConcatKDF digest method"), k.concatDigest);
 	//addItem( tr("ID"), k.id );
-	addItem(tr("Expiry date"), k.cert.expiryDate().toLocalTime().toString(QStringLiteral("dd.MM.yyyy hh:mm:ss")));
-	addItem(tr("Issuer"), SslCertificate(k.cert).issuerInfo(QSslCertificate::CommonName));
+	addItem(tr("Expiry date"), k.cert().expiryDate().toLocalTime().toString(QStringLiteral("dd.MM.yyyy hh:mm:ss")));
+	addItem(tr("Issuer"), SslCertificate(k.cert()).issuerInfo(QSslCertificate::CommonName));
 	d->view->resizeColumnToContents( 0 );
 	if(!k.agreement.isEmpty())
 		adjustSize();
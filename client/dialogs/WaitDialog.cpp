@@ -87,6 +87,19 @@ WaitDialogHolder::~WaitDialogHolder()
 	WaitDialog::destroy();
 }
 
+void WaitDialogHolder::setText(const QString &text)
+{
+	if(WaitDialog *d = WaitDialog::instance())
+		d->setText(text);
+}
+
+// Escape closes the dialog and cancels the operation
+void WaitDialogHolder::onCancel(const std::function<void()> &cancel)
+{
+	if(WaitDialog *d = WaitDialog::instance())
+		QObject::connect(d, &QDialog::rejected, cancel);
+}
+
 
 
 WaitDialogHider::WaitDialogHider()
@@ -21,6 +21,8 @@
 
 #include <QWidget>
 
+#include <functional>
+
 class WaitDialogHider
 {
 public:
@@ -34,4 +36,7 @@ class WaitDialogHolder
 public:
 	WaitDialogHolder(QWidget *parent, const QString &text, bool show = true);
 	~WaitDialogHolder();
+
+	void setText(const QString &text);
+	void onCancel(const std::function<void()> &cancel);
 };
@@ -19,16 +19,219 @@
 
 #include "Application.h"
 
+#include "CryptoDoc.h"
 #include "DiagnosticsTask.h"
+#include "Utils.h"
+#ifdef BUILD_BENCHMARK
+#include "bench/CryptoDocBench.h"
+#endif
 
+#include <QtCore/QDir>
+#include <QtCore/QDirIterator>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QHash>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QThreadPool>
 #include <QtCore/QTimer>
 #include <QtCore/QRegularExpression>
 
+#include <atomic>
+#include <iostream>
+#include <mutex>
+
 #ifdef Q_OS_WIN32
 #include <QtCore/QDebug>
 #include <QtCore/qt_windows.h>
 #endif
 
+static void initApp(QCoreApplication &qtApp)
+{
+	qtApp.setApplicationName(QStringLiteral("qdigidoc4"));
+	qtApp.setApplicationVersion(QStringLiteral("%1.%2.%3.%4")
+		.arg(MAJOR_VER).arg(MINOR_VER).arg(RELEASE_VER).arg(BUILD_VER));
+	qtApp.setOrganizationDomain(QStringLiteral("ria.ee"));
+	qtApp.setOrganizationName(QStringLiteral("RIA"));
+}
+
+/**
+ * Encrypts each input file to a separate CDOC for the same recipients:
+ * qdigidoc4 -encrypt -recipient:<cert> [-recipient:<cert>...] [-out:<dir>] [-jobs:<count>] [-force] <file>...
+ * Recipient certificates are parsed once and shared between the jobs.
+ * Existing CDOC files are overwritten only with -force, inputs with the same target are rejected.
+ */
+static int batchEncrypt(const QStringList &args)
+{
+	QList<CKey> keys;
+	QStringList inputs;
+	QString outDir;
+	int jobs = 0;
+	bool force = false;
+	for(const QString &arg: args)
+	{
+		if(arg.startsWith(QStringLiteral("-recipient:")))
+		{
+			QString path = arg.mid(11);
+			QFile file(path);
+			if(!file.open(QFile::ReadOnly))
+			{
+				std::cerr << path.toStdString() << ": " << file.errorString().toStdString() << std::endl;
+				return 1;
+			}
+			QByteArray data = file.readAll();
+			QSslCertificate cert(data, data.startsWith("-----BEGIN") ? QSsl::Pem : QSsl::Der);
+			if(cert.isNull())
+			{
+				std::cerr << path.toStdString() << ": invalid certificate" << std::endl;
+				return 1;
+			}
+			keys << CKey(cert);
+		}
+		else if(arg.startsWith(QStringLiteral("-out:")))
+			outDir = arg.mid(5);
+		else if(arg.startsWith(QStringLiteral("-jobs:")))
+			jobs = arg.mid(6).toInt();
+		else if(arg == QStringLiteral("-force"))
+			force = true;
+		else
+			inputs << arg;
+	}
+	if(keys.isEmpty() || inputs.isEmpty())
+	{
+		std::cerr << "Usage: qdigidoc4 -encrypt -recipient:<cert> [-recipient:<cert>...] [-out:<dir>] [-jobs:<count>] [-force] <file>..." << std::endl;
+		return 1;
+	}
+
+	// Targets are checked before any job starts, so two jobs never write the same file
+	QStringList targets;
+	QHash<QString,QString> targetInputs;
+	bool conflict = false;
+	for(const QString &input: qAsConst(inputs))
+	{
+		QFileInfo info(input);
+		QString cdoc = QDir(outDir.isEmpty() ? info.absolutePath() : outDir).absoluteFilePath(info.fileName() + QStringLiteral(".cdoc"));
+#if defined(Q_OS_WIN) || defined(Q_OS_MAC)
+		QString key = QDir::cleanPath(cdoc).toCaseFolded();
+#else
+		QString key = QDir::cleanPath(cdoc);
+#endif
+		if(targetInputs.contains(key))
+		{
+			std::cerr << input.toStdString() << ": same target " << cdoc.toStdString() << " as "
+				<< targetInputs.value(key).toStdString() << std::endl;
+			conflict = true;
+		}
+		else if(!force && QFileInfo::exists(cdoc))
+		{
+			std::cerr << input.toStdString() << ": " << cdoc.toStdString() << " already exists, use -force to overwrite" << std::endl;
+			conflict = true;
+		}
+		targetInputs.insert(key, input);
+		targets << cdoc;
+	}
+	if(conflict)
+		return 1;
+
+	// Settings are read once here, workers only get the resulting options
+	const CryptoDoc::EncryptOptions options = CryptoDoc::EncryptOptions::fromSettings();
+	if(jobs > QThreadPool::globalInstance()->maxThreadCount())
+		QThreadPool::globalInstance()->setMaxThreadCount(jobs);
+	std::mutex lock;
+	std::atomic<int> failed{0};
+	std::atomic<qint64> totalBytes{0};
+	QElapsedTimer total;
+	total.start();
+	parallelFor(inputs.size(), [&](int i) {
+		QFileInfo info(inputs.at(i));
+		const QString &cdoc = targets.at(i);
+		QString error;
+		QElapsedTimer timer;
+		timer.start();
+		bool result = CryptoDoc::encryptFile(info.filePath(), cdoc, keys, options, error);
+		qint64 elapsed = std::max<qint64>(1, timer.elapsed());
+		std::lock_guard<std::mutex> guard(lock);
+		if(!result)
+		{
+			++failed;
+			std::cerr << info.filePath().toStdString() << ": " << error.toStdString() << std::endl;
+			return;
+		}
+		totalBytes += info.size();
+		std::cout << info.filePath().toStdString() << " -> " << cdoc.toStdString() << ": "
+			<< info.size() << " bytes " << elapsed << " ms "
+			<< QString::number(double(info.size()) / 1048576.0 / (double(elapsed) / 1000.0), 'f', 2).toStdString() << " MB/s" << std::endl;
+	}, jobs);
+	qint64 elapsed = std::max<qint64>(1, total.elapsed());
+	std::cout << "Encrypted " << inputs.size() - failed.load() << "/" << inputs.size() << " files "
+		<< totalBytes.load() << " bytes " << elapsed << " ms "
+		<< QString::number(double(totalBytes.load()) / 1048576.0 / (double(elapsed) / 1000.0), 'f', 2).toStdString() << " MB/s" << std::endl;
+	return failed > 0 ? 1 : 0;
+}
+
+/**
+ * Lists recipients of CDOC files as JSON lines, one object per file:
+ * qdigidoc4 -scan [-out:<file>] [-jobs:<count>] <dir|file>...
+ * Directories are searched recursively for *.cdoc files. Only the document header is read,
+ * so the scan is limited by file system access rather than CPU.
+ */
+static int scanInventory(const QStringList &args)
+{
+	QStringList inputs, files;
+	QString outFile;
+	int jobs = 0;
+	for(const QString &arg: args)
+	{
+		if(arg.startsWith(QStringLiteral("-out:")))
+			outFile = arg.mid(5);
+		else if(arg.startsWith(QStringLiteral("-jobs:")))
+			jobs = arg.mid(6).toInt();
+		else
+			inputs << arg;
+	}
+	if(inputs.isEmpty())
+	{
+		std::cerr << "Usage: qdigidoc4 -scan [-out:<file>] [-jobs:<count>] <dir|file>..." << std::endl;
+		return 1;
+	}
+	for(const QString &input: qAsConst(inputs))
+	{
+		if(!QFileInfo(input).isDir())
+		{
+			files << input;
+			continue;
+		}
+		QDirIterator it(input, {QStringLiteral("*.cdoc")}, QDir::Files, QDirIterator::Subdirectories);
+		while(it.hasNext())
+			files << it.next();
+	}
+
+	QFile out(outFile);
+	if(!(outFile.isEmpty() ? out.open(stdout, QFile::WriteOnly) : out.open(QFile::WriteOnly)))
+	{
+		std::cerr << outFile.toStdString() << ": " << out.errorString().toStdString() << std::endl;
+		return 1;
+	}
+	if(jobs > QThreadPool::globalInstance()->maxThreadCount())
+		QThreadPool::globalInstance()->setMaxThreadCount(jobs);
+	std::mutex lock;
+	std::atomic<int> failed{0};
+	QElapsedTimer total;
+	total.start();
+	parallelFor(files.size(), [&](int i) {
+		QJsonObject result = CryptoDoc::inventory(files.at(i));
+		if(result.contains(QStringLiteral("error")))
+			++failed;
+		QByteArray line = QJsonDocument(result).toJson(QJsonDocument::Compact) + '\n';
+		std::lock_guard<std::mutex> guard(lock);
+		out.write(line);
+	}, jobs);
+	out.close();
+	std::cerr << "Scanned " << files.size() - failed.load() << "/" << files.size() << " files "
+		<< total.elapsed() << " ms" << std::endl;
+	return failed > 0 ? 1 : 0;
+}
+
 int main( int argc, char *argv[] )
 {
 #if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
@@ -53,11 +256,7 @@ int main( int argc, char *argv[] )
 		if(parameter.startsWith(QStringLiteral("-diag")))
 		{
 			QCoreApplication qtApp( argc, argv );
-			qtApp.setApplicationName(QStringLiteral("qdigidoc4"));
-			qtApp.setApplicationVersion(QStringLiteral("%1.%2.%3.%4")
-				.arg(MAJOR_VER).arg(MINOR_VER).arg(RELEASE_VER).arg(BUILD_VER));
-			qtApp.setOrganizationDomain(QStringLiteral("ria.ee"));
-			qtApp.setOrganizationName(QStringLiteral("RIA"));
+			initApp(qtApp);
 
 			Application::initDiagnosticConf();
 			DiagnosticsTask task(&qtApp, parameter.remove(QStringLiteral("-diag")).remove(QRegularExpression(QStringLiteral("^[:]*"))));
@@ -67,6 +266,27 @@ int main( int argc, char *argv[] )
 			QTimer::singleShot(0, &task, &DiagnosticsTask::run);
 			return qtApp.exec();
 		}
+		if(parameter == QStringLiteral("-encrypt"))
+		{
+			QCoreApplication qtApp( argc, argv );
+			initApp(qtApp);
+			QStringList args = QCoreApplication::arguments().mid(i + 1);
+			return batchEncrypt(args);
+		}
+		if(parameter == QStringLiteral("-scan"))
+		{
+			QCoreApplication qtApp( argc, argv );
+			initApp(qtApp);
+			return scanInventory(QCoreApplication::arguments().mid(i + 1));
+		}
+#ifdef BUILD_BENCHMARK
+		if(parameter == QStringLiteral("-bench"))
+		{
+			QCoreApplication qtApp( argc, argv );
+			initApp(qtApp);
+			return runBenchmark(QCoreApplication::arguments().mid(i + 1));
+		}
+#endif
 	}
 
 	return Application( argc, argv ).run();
@@ -4,5 +4,19 @@
 qdigidoc4 \- Application for verifying and signing digital signatures
 .SH SYNOPSIS
 qdigidoc4 [FILES]
+.br
+qdigidoc4 -encrypt -recipient:CERT [-recipient:CERT...] [-out:DIR] [-jobs:COUNT] FILES
+.br
+qdigidoc4 -scan [-out:FILE] [-jobs:COUNT] DIRS|FILES
+.SH OPTIONS
+.TP
+.B -encrypt
+Encrypt each of FILES to a separate FILE.cdoc without user interface and print timing and throughput per file.
+CERT is a recipient certificate in PEM or DER format, DIR is the output directory and COUNT is the number of parallel jobs.
+.TP
+.B -scan
+Print recipients, encryption method, document format and original file names of each CDOC file as a JSON line
+to standard output or FILE. DIRS are searched recursively for *.cdoc files and the encrypted payload is not read.
+COUNT is the number of parallel jobs.
 .SH SEE ALSO
 qdigidocclient(1), digidoc-tool(1), qesteidutil(1)
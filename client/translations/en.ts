@@ -660,6 +660,22 @@
         <source>Digi-ID</source>
         <translation>Digi-ID</translation>
     </message>
+    <message>
+        <source>Container is not encrypted</source>
+        <translation>Container is not encrypted</translation>
+    </message>
+    <message>
+        <source>Failed to change recipients</source>
+        <translation>Failed to change recipients</translation>
+    </message>
+    <message>
+        <source>Failed to decrypt the key of this document</source>
+        <translation>Failed to decrypt the key of this document</translation>
+    </message>
+    <message>
+        <source>Failed to save file &apos;%1&apos;</source>
+        <translation>Failed to save file &apos;%1&apos;</translation>
+    </message>
 </context>
 <context>
     <name>Diagnostics</name>
@@ -1632,6 +1648,10 @@ ID-CARD</translation>
         <source>Encrypting</source>
         <translation>Encrypting</translation>
     </message>
+    <message>
+        <source>Encrypting %1%</source>
+        <translation>Encrypting %1%</translation>
+    </message>
     <message>
         <source>Changing %1 failed</source>
         <translation>Changing %1 failed</translation>
@@ -1708,6 +1728,47 @@ ID-CARD</translation>
         <source>Decrypting</source>
         <translation>Decrypting</translation>
     </message>
+    <message>
+        <source>Decrypting %1%</source>
+        <translation>Decrypting %1%</translation>
+    </message>
+    <message>
+        <source>Select folder where decrypted files will be stored</source>
+        <translation>Select folder where decrypted files will be stored</translation>
+    </message>
+    <message>
+        <source>Decrypted %1 of %2 documents</source>
+        <translation>Decrypted %1 of %2 documents</translation>
+    </message>
+    <message>
+        <source>Decrypt several documents</source>
+        <translation>DECRYPT SEVERAL DOCUMENTS</translation>
+    </message>
+    <message>
+        <source>Decrypt several documents to a folder</source>
+        <comment>accessible</comment>
+        <translation>Decrypt several documents to a folder</translation>
+    </message>
+    <message>
+        <source>Failed to open document</source>
+        <translation>Failed to open document</translation>
+    </message>
+    <message>
+        <source>Document was not decrypted</source>
+        <translation>Document was not decrypted</translation>
+    </message>
+    <message>
+        <source>Failed to create folder %1</source>
+        <translation>Failed to create folder %1</translation>
+    </message>
+    <message>
+        <source>File %1 already exists</source>
+        <translation>File %1 already exists</translation>
+    </message>
+    <message>
+        <source>Failed to save file %1</source>
+        <translation>Failed to save file %1</translation>
+    </message>
 </context>
 <context>
     <name>MobileDialog</name>
@@ -3042,6 +3103,16 @@ Additional licenses and components</translation>
         <extracomment>accessible</extracomment>
         <translation>To view signature details press enter or space</translation>
     </message>
+    <message>
+        <source>is being validated</source>
+        <comment>Signature</comment>
+        <translation>is being validated</translation>
+    </message>
+    <message>
+        <source>is being validated</source>
+        <comment>Timestamp</comment>
+        <translation>is being validated</translation>
+    </message>
 </context>
 <context>
     <name>SmartIDDialog</name>
@@ -660,6 +660,22 @@
         <source>Digi-ID</source>
         <translation>Digi-ID</translation>
     </message>
+    <message>
+        <source>Container is not encrypted</source>
+        <translation>Ümbrik ei ole krüpteeritud</translation>
+    </message>
+    <message>
+        <source>Failed to change recipients</source>
+        <translation>Adressaatide muutmine ebaõnnestus</translation>
+    </message>
+    <message>
+        <source>Failed to decrypt the key of this document</source>
+        <translation>Selle dokumendi võtme dekrüpteerimine ebaõnnestus</translation>
+    </message>
+    <message>
+        <source>Failed to save file &apos;%1&apos;</source>
+        <translation>Faili &apos;%1&apos; salvestamine ebaõnnestus</translation>
+    </message>
 </context>
 <context>
     <name>Diagnostics</name>
@@ -1632,6 +1648,10 @@ ID-KAARDIGA</translation>
         <source>Encrypting</source>
         <translation>Krüpteerin</translation>
     </message>
+    <message>
+        <source>Encrypting %1%</source>
+        <translation>Krüpteerin %1%</translation>
+    </message>
     <message>
         <source>Changing %1 failed</source>
         <translation>%1 muutmine ebaõnnestus</translation>
@@ -1708,6 +1728,47 @@ ID-KAARDIGA</translation>
         <source>Decrypting</source>
         <translation>Dekrüpteerin</translation>
     </message>
+    <message>
+        <source>Decrypting %1%</source>
+        <translation>Dekrüpteerin %1%</translation>
+    </message>
+    <message>
+        <source>Select folder where decrypted files will be stored</source>
+        <translation>Vali kaust, kuhu dekrüpteeritud failid salvestatakse</translation>
+    </message>
+    <message>
+        <source>Decrypted %1 of %2 documents</source>
+        <translation>Dekrüpteeritud %2-st dokumendist %1</translation>
+    </message>
+    <message>
+        <source>Decrypt several documents</source>
+        <translation>DEKRÜPTEERI MITU DOKUMENTI</translation>
+    </message>
+    <message>
+        <source>Decrypt several documents to a folder</source>
+        <comment>accessible</comment>
+        <translation>Dekrüpteeri mitu dokumenti kausta</translation>
+    </message>
+    <message>
+        <source>Failed to open document</source>
+        <translation>Dokumendi avamine ebaõnnestus</translation>
+    </message>
+    <message>
+        <source>Document was not decrypted</source>
+        <translation>Dokumenti ei dekrüpteeritud</translation>
+    </message>
+    <message>
+        <source>Failed to create folder %1</source>
+        <translation>Kausta %1 loomine ebaõnnestus</translation>
+    </message>
+    <message>
+        <source>File %1 already exists</source>
+        <translation>Fail %1 on juba olemas</translation>
+    </message>
+    <message>
+        <source>Failed to save file %1</source>
+        <translation>Faili %1 salvestamine ebaõnnestus</translation>
+    </message>
 </context>
 <context>
     <name>MobileDialog</name>
@@ -3042,6 +3103,16 @@ Täiendavad litsentsid ja komponendid</translation>
         <extracomment>accessible</extracomment>
         <translation>Allkirja detailide vaatamiseks vajuta space või enter</translation>
     </message>
+    <message>
+        <source>is being validated</source>
+        <comment>Signature</comment>
+        <translation>kontrollitakse</translation>
+    </message>
+    <message>
+        <source>is being validated</source>
+        <comment>Timestamp</comment>
+        <translation>kontrollitakse</translation>
+    </message>
 </context>
 <context>
     <name>SmartIDDialog</name>
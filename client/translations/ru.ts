@@ -662,6 +662,22 @@
         <source>Digi-ID</source>
         <translation>Digi-ID</translation>
     </message>
+    <message>
+        <source>Container is not encrypted</source>
+        <translation>Конверт не зашифрован</translation>
+    </message>
+    <message>
+        <source>Failed to change recipients</source>
+        <translation>Не удалось изменить получателей</translation>
+    </message>
+    <message>
+        <source>Failed to decrypt the key of this document</source>
+        <translation>Не удалось расшифровать ключ этого документа</translation>
+    </message>
+    <message>
+        <source>Failed to save file &apos;%1&apos;</source>
+        <translation>Неудачное сохранение файла &apos;%1&apos;</translation>
+    </message>
 </context>
 <context>
     <name>Diagnostics</name>
@@ -1634,6 +1650,10 @@ ID-КАРТОЙ</translation>
         <source>Encrypting</source>
         <translation>Зашифровывание</translation>
     </message>
+    <message>
+        <source>Encrypting %1%</source>
+        <translation>Зашифровывание %1%</translation>
+    </message>
     <message>
         <source>Changing %1 failed</source>
         <translation>Смена %1-кода прошла неудачно</translation>
@@ -1711,6 +1731,47 @@ ID-КАРТОЙ</translation>
         <source>Decrypting</source>
         <translation>Расшифровка</translation>
     </message>
+    <message>
+        <source>Decrypting %1%</source>
+        <translation>Расшифровка %1%</translation>
+    </message>
+    <message>
+        <source>Select folder where decrypted files will be stored</source>
+        <translation>Выберите папку для сохранения расшифрованных файлов</translation>
+    </message>
+    <message>
+        <source>Decrypted %1 of %2 documents</source>
+        <translation>Расшифровано документов: %1 из %2</translation>
+    </message>
+    <message>
+        <source>Decrypt several documents</source>
+        <translation>РАСШИФРОВАТЬ НЕСКОЛЬКО ДОКУМЕНТОВ</translation>
+    </message>
+    <message>
+        <source>Decrypt several documents to a folder</source>
+        <comment>accessible</comment>
+        <translation>Расшифровать несколько документов в папку</translation>
+    </message>
+    <message>
+        <source>Failed to open document</source>
+        <translation>Не удалось открыть документ</translation>
+    </message>
+    <message>
+        <source>Document was not decrypted</source>
+        <translation>Документ не расшифрован</translation>
+    </message>
+    <message>
+        <source>Failed to create folder %1</source>
+        <translation>Не удалось создать папку %1</translation>
+    </message>
+    <message>
+        <source>File %1 already exists</source>
+        <translation>Файл %1 уже существует</translation>
+    </message>
+    <message>
+        <source>Failed to save file %1</source>
+        <translation>Не удалось сохранить файл %1</translation>
+    </message>
 </context>
 <context>
     <name>MobileDialog</name>
@@ -3045,6 +3106,16 @@ Additional licenses and components</source>
         <extracomment>accessible</extracomment>
         <translation>Для просмотра деталей подписи нажмите пробел или enter</translation>
     </message>
+    <message>
+        <source>is being validated</source>
+        <comment>Signature</comment>
+        <translation>проверяется</translation>
+    </message>
+    <message>
+        <source>is being validated</source>
+        <comment>Timestamp</comment>
+        <translation>проверяется</translation>
+    </message>
 </context>
 <context>
     <name>SmartIDDialog</name>
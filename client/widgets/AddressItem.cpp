@@ -53,10 +53,11 @@ AddressItem::AddressItem(CKey k, QWidget *parent, bool showIcon)
 	ui->added->hide();
 	ui->added->setDisabled(true);
 
-	code = SslCertificate(key.cert).personalCode().toHtmlEscaped();
-	name = (!key.cert.subjectInfo("GN").isEmpty() && !key.cert.subjectInfo("SN").isEmpty() ?
-			key.cert.subjectInfo("GN").join(' ') + " " + key.cert.subjectInfo("SN").join(' ') :
-			key.cert.subjectInfo("CN").join(' ')).toHtmlEscaped();
+	const QSslCertificate cert = key.cert();
+	code = SslCertificate(cert).personalCode().toHtmlEscaped();
+	name = (!cert.subjectInfo("GN").isEmpty() && !cert.subjectInfo("SN").isEmpty() ?
+			cert.subjectInfo("GN").join(' ') + " " + cert.subjectInfo("SN").join(' ') :
+			cert.subjectInfo("CN").join(' ')).toHtmlEscaped();
 	setIdType();
 	showButton(AddressItem::Remove);
 }
@@ -98,7 +99,7 @@ const CKey& AddressItem::getKey() const
 
 void AddressItem::idChanged(const SslCertificate &cert)
 {
-	yourself = !cert.isNull() && key.cert == cert;
+	yourself = !cert.isNull() && key.der() == cert.toDer();
 	setName();
 }
 
@@ -137,7 +138,7 @@ void AddressItem::stateChange(ContainerState state)
 void AddressItem::setIdType()
 {
 	QString str;
-	SslCertificate cert(key.cert);
+	SslCertificate cert(key.cert());
 	SslCertificate::CertType type = cert.type();
 	if(type & SslCertificate::DigiIDType)
 		str = tr("digi-ID");
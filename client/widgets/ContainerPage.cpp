@@ -147,6 +147,7 @@ void ContainerPage::clear()
 	ui->leftPane->clear();
 	ui->rightPane->clear();
 	isSupported = false;
+	++validationJob;
 }
 
 void ContainerPage::clearPopups()
@@ -315,12 +316,10 @@ void ContainerPage::transition(DigiDoc* container)
 {
 	clear();
 	emit action(ClearSignatureWarning);
-	QMap<ria::qdigidoc4::WarningType, int> errors;
+	errors.clear();
 	setHeader(container->fileName());
-	auto addError = [&errors](const SignatureItem* item) {
-		int counter = errors.value(item->getError());
-		errors[item->getError()] = ++counter;
-	};
+	QList<DigiDocSignature> pending;
+	QList<SignatureItem*> items;
 
 	if(!container->timestamps().isEmpty())
 	{
@@ -329,8 +328,8 @@ void ContainerPage::transition(DigiDoc* container)
 		for(const DigiDocSignature &c: container->timestamps())
 		{
 			SignatureItem *item = new SignatureItem(c, container->state(), ui->rightPane);
-			if(item->isInvalid())
-				addError(item);
+			pending.append(c);
+			items.append(item);
 			ui->rightPane->addHeaderWidget(item);
 		}
 	}
@@ -338,13 +337,19 @@ void ContainerPage::transition(DigiDoc* container)
 	for(const DigiDocSignature &c: container->signatures())
 	{
 		SignatureItem *item = new SignatureItem(c, container->state(), ui->rightPane);
-		if(item->isInvalid())
-			addError(item);
+		pending.append(c);
+		items.append(item);
 		ui->rightPane->addWidget(item);
 	}
 
-	for(auto i = errors.constBegin(); i != errors.constEnd(); ++i)
-		emit warning(WarningText(i.key(), i.value()));
+	container->validate(pending, this, [this, items, job = ++validationJob](int i, DigiDocSignature::SignatureStatus status) {
+		if(job != validationJob)
+			return;
+		SignatureItem *item = items.at(i);
+		item->setStatus(status);
+		if(item->isInvalid())
+			emit warning(WarningText(item->getError(), ++errors[item->getError()]));
+	});
 	if(container->fileName().endsWith(QStringLiteral("ddoc"), Qt::CaseInsensitive))
 		emit warning(UnsupportedDDocWarning);
 
@@ -22,6 +22,8 @@
 #include "common_enums.h"
 #include "widgets/MainAction.h"
 
+#include <QtCore/QMap>
+
 #include <memory>
 
 namespace Ui {
@@ -85,6 +87,8 @@ private:
 	QString cardInReader;
 	QString fileName;
 	QString mobileCode;
+	QMap<ria::qdigidoc4::WarningType, int> errors;
+	int validationJob = 0;
 
 	const char *cancelText = "CANCEL";
 	const char *convertText = "ENCRYPT";
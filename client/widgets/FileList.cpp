@@ -100,7 +100,8 @@ bool FileList::eventFilter(QObject *obj, QEvent *event)
 		int i = index(fileItem);
 		if(i == -1)
 			break;
-		QString path = FileDialog::tempPath(fileItem->getFile());
+		QString path = FileDialog::tempPath(FileDialog::safePath(fileItem->getFile()));
+		QDir().mkpath(QFileInfo(path).absolutePath());
 		documentModel->save(i, path);
 		documentModel->addTempReference(path);
 		QMimeData *mimeData = new QMimeData;
@@ -173,7 +174,9 @@ void FileList::saveAll()
 	int b = QMessageBox::No;	// default
 	for( int i = 0; i < documentModel->rowCount(); ++i )
 	{
-		QString dest = dir + QDir::separator() + FileDialog::safeName(documentModel->data(i));
+		// Files of DDoc keep their relative path
+		QString dest = dir + QDir::separator() + FileDialog::safePath(documentModel->data(i));
+		QDir().mkpath(QFileInfo(dest).absolutePath());
 		if( QFile::exists( dest ) )
 		{
 			if( b == QMessageBox::YesToAll )
@@ -41,12 +41,14 @@ class SignatureItem::Private: public Ui::SignatureItem
 public:
 	explicit Private(DigiDocSignature s): signature(std::move(s)) {}
 	DigiDocSignature signature;
+	DigiDocSignature::SignatureStatus status = DigiDocSignature::Unknown;
 
-	bool invalid = true;
+	bool validating = true;
+	bool invalid = false;
 	ria::qdigidoc4::WarningType error = ria::qdigidoc4::NoWarning;
 	QString nameText;
 	QString serial;
-	QString status;
+	QString statusText;
 	QString roleText;
 };
 
@@ -78,18 +80,17 @@ SignatureItem::~SignatureItem()
 void SignatureItem::init()
 {
 	const SslCertificate cert = ui->signature.cert();
-	DigiDocSignature::SignatureStatus signatureValidity = ui->signature.validate();
 
 	ui->serial.clear();
-	ui->status.clear();
+	ui->statusText.clear();
 	ui->error = ria::qdigidoc4::NoWarning;
-	ui->invalid = signatureValidity >= DigiDocSignature::Invalid;
+	ui->invalid = !ui->validating && ui->status >= DigiDocSignature::Invalid;
 	if(!cert.isNull())
 		ui->nameText = cert.toString(cert.showCN() ? QStringLiteral("CN") : QStringLiteral("GN SN")).toHtmlEscaped();
 	else
 		ui->nameText = ui->signature.signedBy().toHtmlEscaped();
 
-	QTextStream s(&ui->status);
+	QTextStream s(&ui->statusText);
 	bool isSignature = true;
 	QString label = tr("Signature");
 	if(ui->signature.profile() == QStringLiteral("TimeStampToken"))
@@ -112,7 +113,9 @@ void SignatureItem::init()
 	auto isUnknown = [&isSignature] {
 		return isSignature ? tr("is unknown", "Signature") : tr("is unknown", "Timestamp");
 	};
-	switch( signatureValidity )
+	if(ui->validating)
+		s << label << " " << (isSignature ? tr("is being validated", "Signature") : tr("is being validated", "Timestamp"));
+	else switch( ui->status )
 	{
 	case DigiDocSignature::Valid:
 		s << "<font color=\"green\">" << label << " " << isValid() << "</font>";
@@ -244,15 +247,22 @@ void SignatureItem::removeSignature()
 		emit remove(this);
 }
 
+void SignatureItem::setStatus(DigiDocSignature::SignatureStatus status)
+{
+	ui->validating = false;
+	ui->status = status;
+	init();
+}
+
 void SignatureItem::updateNameField()
 {
 	QTextDocument doc;
-	doc.setHtml(ui->status);
+	doc.setHtml(ui->statusText);
 	QString plain = doc.toPlainText();
 	if(ui->name->fontMetrics().boundingRect(ui->nameText  + " - " + plain).width() < ui->name->width())
-		ui->name->setText(red(ui->nameText + " - ", ui->invalid) + ui->status);
+		ui->name->setText(red(ui->nameText + " - ", ui->invalid) + ui->statusText);
 	else
-		ui->name->setText(QStringLiteral("%1<br />%2").arg(red(ui->nameText, ui->invalid), ui->status));
+		ui->name->setText(QStringLiteral("%1<br />%2").arg(red(ui->nameText, ui->invalid), ui->statusText));
 	ui->name->setAccessibleName(QStringLiteral("%1. %2 %3").arg(plain, ui->role->text(), ui->idSignTime->text()));
 	ui->role->setText(ui->role->fontMetrics().elidedText(
 		ui->roleText, Qt::ElideRight, ui->role->width() - 10, Qt::TextShowMnemonic));
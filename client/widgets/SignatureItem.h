@@ -20,10 +20,9 @@
 #pragma once
 
 #include "common_enums.h"
+#include "DigiDoc.h"
 #include "widgets/Item.h"
 
-class DigiDocSignature;
-
 class SignatureItem final : public Item
 {
 	Q_OBJECT
@@ -37,6 +36,8 @@ public:
 	QWidget* initTabOrder(QWidget *item) final;
 	bool isInvalid() const;
 	bool isSelfSigned(const QString& cardCode, const QString& mobileCode) const;
+	// Item is shown as being validated until status is set
+	void setStatus(DigiDocSignature::SignatureStatus status);
 
 public slots:
 	void details() final;
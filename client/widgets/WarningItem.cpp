@@ -162,6 +162,14 @@ void WarningItem::lookupWarning()
 	setAccessibleName(ui->warningText);
 }
 
+void WarningItem::setCounter(int counter)
+{
+	if(warnText.counter == counter)
+		return;
+	warnText.counter = counter;
+	lookupWarning();
+}
+
 ria::qdigidoc4::WarningType WarningItem::warningType() const
 {
 	return warnText.warningType;
@@ -44,6 +44,7 @@ public:
 	~WarningItem() final;
 	
 	int page() const;
+	void setCounter(int counter);
 	ria::qdigidoc4::WarningType warningType() const;
 
 signals:
@@ -96,7 +96,10 @@ void WarningList::showWarning(const WarningText &warningText)
 		for(auto warning: warnings)
 		{
 			if(warning->warningType() == warningText.warningType)
+			{
+				warning->setCounter(warningText.counter);
 				return;
+			}
 		}
 	}
 	WarningItem *warning = new WarningItem(warningText, ui->page);